@@ -0,0 +1,54 @@
+/*
+ * Copyright 2023 Ettus Research, A National Instruments Brand
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/*!
+ * \brief Convert interleaved complex float samples to interleaved complex int16
+ *
+ * Every component is multiplied by scale, rounded to nearest and saturated to the int16
+ * range. Uses SIMD where the target supports it.
+ *
+ * \param in nitems complex fc32 samples
+ * \param out room for nitems complex sc16 samples
+ * \param nitems number of complex samples
+ * \param scale factor applied before rounding; 32767 maps ±1.0 to full scale
+ * \return number of components (I or Q) that had to be saturated
+ */
+size_t convert_fc32_to_sc16(
+    const float* in, int16_t* out, size_t nitems, float scale = 32767.0f);
+
+/*!
+ * \brief Scale and rotate interleaved complex float samples
+ *
+ * out[n] = gain · in[n] · exp(j·(phase + 2π·frequency·n)), i.e. a complex frequency
+ * shift. The oscillator is recomputed exactly every few hundred samples, so long
+ * segments don't accumulate phase error. in and out may be the same.
+ *
+ * \param frequency in cycles per sample
+ * \param phase in radians, at in[0]
+ */
+void mix_fc32(const float* in,
+    float* out,
+    size_t nitems,
+    float gain,
+    double frequency,
+    double phase);
+
+/*!
+ * \brief mix_fc32() for interleaved complex int16 samples
+ *
+ * \return number of components (I or Q) that had to be saturated
+ */
+size_t mix_sc16(const int16_t* in,
+    int16_t* out,
+    size_t nitems,
+    float gain,
+    double frequency,
+    double phase);
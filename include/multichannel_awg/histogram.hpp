@@ -0,0 +1,52 @@
+/*
+ * Copyright 2023 Ettus Research, A National Instruments Brand
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+#pragma once
+
+#include <nlohmann/json_fwd.hpp>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+/*!
+ * \brief Histogram with power-of-two buckets
+ *
+ * Bucket n counts values in [2^(n-1), 2^n); bucket 0 counts zeros. Recording doesn't
+ * allocate or lock; it is meant to be called from a single thread, while any thread may
+ * read or export it.
+ */
+class log_histogram
+{
+public:
+    static constexpr size_t NUM_BUCKETS = 64;
+
+    void record(uint64_t value);
+    //! \brief count, min, max, mean and the non-empty buckets, keyed by upper bound
+    nlohmann::json to_json() const;
+
+private:
+    std::array<std::atomic<uint64_t>, NUM_BUCKETS> buckets{};
+    std::atomic<uint64_t> count{0};
+    std::atomic<uint64_t> sum{0};
+    std::atomic<uint64_t> min{UINT64_MAX};
+    std::atomic<uint64_t> max{0};
+};
+
+//! \brief Timing statistics of one channel's streaming loop, in nanoseconds
+struct stream_timing
+{
+    //! duration of tx_streamer::send() calls
+    log_histogram send_latency;
+    //! how far ahead of the device time a packet was handed to send()
+    log_histogram slack;
+    //! how far behind the device time a packet was handed to send()
+    log_histogram late;
+
+    //! \param slack_ns packet time minus device time; negative if late
+    void record(uint64_t send_ns, int64_t slack_ns);
+    nlohmann::json to_json() const;
+};
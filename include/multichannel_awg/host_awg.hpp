@@ -6,15 +6,28 @@
  */
 #pragma once
 
+#include "histogram.hpp"
 #include "multichannel_awg.hpp"
+#include "segment_reader.hpp"
+#include "segment_store.hpp"
 #include "sequence.hpp"
+#include "timeline.hpp"
+#include "tx_monitor.hpp"
 #include <memory>
 #include <string>
+#include <thread>
 #include <tuple>
 #include <utility>
 #include <vector>
 #include <unordered_map>
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <span>
 
 
 // fwd decl
@@ -23,46 +36,268 @@ namespace usrp {
 class multi_usrp;
 } // namespace usrp
 class tx_streamer;
+struct tx_metadata_t;
+struct stream_args_t;
 } // namespace uhd
 
 
+/*!
+ * \brief Estimates device time from the host's steady clock
+ *
+ * Avoids a device round trip per packet when measuring slack; taken once when
+ * streaming starts.
+ */
+struct device_clock
+{
+    std::chrono::steady_clock::time_point host_ref;
+    double device_ref = 0.0;
+
+    double at(std::chrono::steady_clock::time_point host_time) const
+    {
+        return device_ref
+               + std::chrono::duration<double>(host_time - host_ref).count();
+    }
+};
+
+//! \brief A program swapped in while running, with its segment data
+struct loaded_program
+{
+    std::unique_ptr<sequencer_data> data;
+    segment_store store;
+};
+
+//! \brief A program swap, as posted to the streaming workers
+struct program_swap
+{
+    std::shared_ptr<const loaded_program> program;
+    //! tick (since the first program's time 0) that is the new program's time 0
+    uint64_t tick;
+};
+
+/*!
+ * \brief Hands a program swap to one channel's worker
+ *
+ * The worker checks due() at every repetition boundary, which is cheap while nothing
+ * is posted. A swap posted before the previous one was taken replaces it.
+ */
+class swap_slot
+{
+public:
+    void post(std::shared_ptr<const program_swap> swap);
+    //! \brief true if a swap is posted that should be taken at tick
+    bool due(uint64_t tick) const
+    {
+        return tick >= due_tick.load();
+    }
+    //! \brief the posted swap if it's due at tick, otherwise nullptr
+    std::shared_ptr<const program_swap> take(uint64_t tick);
+
+private:
+    std::mutex mutex;
+    std::shared_ptr<const program_swap> posted;
+    std::atomic<uint64_t> due_tick{UINT64_MAX};
+};
+
+/*!
+ * \brief Frees programs that the streaming workers are done with, on its own thread
+ *
+ * Dropping a program frees its segments and unmaps its files, which mustn't hold up a
+ * streaming worker. Retired programs are dropped as soon as they arrive; a program that
+ * another channel still plays lives on until that channel retires it too.
+ */
+class program_reaper
+{
+public:
+    program_reaper();
+    //! drops what is left, then stops the thread
+    ~program_reaper();
+    program_reaper(const program_reaper&) = delete;
+    program_reaper& operator=(const program_reaper&) = delete;
+
+    //! \brief hands over a program the caller no longer plays
+    void retire(std::shared_ptr<const loaded_program> program);
+
+private:
+    void run();
+
+    std::mutex mutex;
+    std::condition_variable retired_cv;
+    std::vector<std::shared_ptr<const loaded_program>> retired;
+    bool done = false;
+    std::thread thread;
+};
+
 struct sequencer_state
 {
 public:
-    using sp_container = std::vector<sequence_point>;
-    sequencer_state(sp_container::iterator&& begin,
-        sp_container::const_iterator&& end,
+    sequencer_state(size_t channel,
+        std::span<const timeline_entry> timeline,
         sequencer_data* data,
-        const std::shared_ptr<uhd::usrp::multi_usrp>& usrp)
-        : begin(begin), end(end), usrp(usrp), data(data)
+        const std::shared_ptr<uhd::usrp::multi_usrp>& usrp,
+        const std::atomic<bool>& stop)
+        : channel(channel), timeline(timeline), usrp(usrp), data(data), stop(stop)
     {
     }
-    sp_container::iterator begin;
-    sp_container::const_iterator end;
+    size_t channel;
+    std::span<const timeline_entry> timeline;
     std::shared_ptr<uhd::tx_streamer> tx_streamer;
     std::shared_ptr<uhd::usrp::multi_usrp> usrp;
     void operator()();
-    const sequencer_data* const data;
+    //! program being played; changes when a swap is taken
+    const sequencer_data* data;
+    //! keeps data alive, if it's a swappable program
+    std::shared_ptr<const loaded_program> loaded;
+    const std::atomic<bool>& stop;
+    stream_timing* timing      = nullptr;
+    const device_clock* clock = nullptr;
+    //! swaps posted to this channel; nullptr: the program is never swapped
+    swap_slot* swaps = nullptr;
+    //! takes the programs that swaps replace
+    program_reaper* reaper = nullptr;
+    //! wait for a swap when the program ends, instead of finishing
+    bool hold = false;
+
+private:
+    //! send() that records its latency and the packet's slack
+    size_t timed_send(const char* buff,
+        size_t nsamps,
+        const uhd::tx_metadata_t& metadata,
+        double packet_time);
+
+    /*!
+     * \brief plays one timeline entry; burst_end is where the running burst ends
+     *
+     * \return false if cut short at a repetition boundary by a due swap; burst_end then
+     *         is that boundary
+     */
+    bool play(const timeline_entry& entry,
+        uhd::tx_metadata_t& metadata,
+        uint64_t& burst_end,
+        const timeline_entry* upcoming = nullptr);
+
+    //! \brief sends nsamps samples due at tick, in packets; returns the number sent
+    uint64_t send_span(
+        const char* buff, uint64_t nsamps, uint64_t tick, uhd::tx_metadata_t& metadata);
+
+    void stream_from_disk(const segment_spec& sspec,
+        const timeline_entry& entry,
+        uhd::tx_metadata_t& metadata,
+        const timeline_entry* upcoming);
+
+    /*!
+     * \brief Opens the reader for upcoming if it's streamed, so that its first blocks
+     * are read while the current entry still plays
+     */
+    void prefetch(const timeline_entry* upcoming);
+
+    //! reader opened by prefetch(), for the segment and play count in prefetched_for
+    std::unique_ptr<segment_reader> prefetched;
+    std::pair<const segment_spec*, uint64_t> prefetched_for{nullptr, 0};
+};
+
+/*!
+ * \brief Walks one channel's timeline
+ *
+ * Used by the aligned streamer: every call to fill() produces the next packet's worth of
+ * samples for this channel, zero-filled wherever the channel is idle.
+ */
+struct channel_cursor
+{
+    const compiled_program* program = nullptr;
+    timeline_cursor timeline;
+    //! segment entry being played
+    timeline_entry current;
+    bool has_current = false;
+    //! completed plays of the current entry
+    uint64_t played = 0;
+    //! next sample of the current entry
+    uint64_t position = 0;
+    //! tick at which the sample at position is due
+    uint64_t next_tick = 0;
+
+    bool finished() const
+    {
+        return !has_current;
+    }
+    //! \brief returns a pointer to nsamps samples starting at tick; either straight into
+    //! segment data, or into scratch, which must hold nsamps samples
+    const char* fill(uint64_t tick, size_t nsamps, size_t itemsize, char* scratch);
+
+private:
+    void advance(size_t nsamps);
+};
+
+//! \brief Streams all used channels through a single multi-channel tx_streamer
+struct aligned_sequencer_state
+{
+    std::vector<size_t> channels;
+    std::vector<channel_cursor> cursors;
+    std::shared_ptr<uhd::tx_streamer> tx_streamer;
+    size_t itemsize;
+    double sampling_rate;
+    //! one per channel
+    std::vector<stream_timing*> timings;
+    const device_clock* clock = nullptr;
+    void operator()(const std::atomic<bool>& stop);
 };
 
 class host_awg : virtual public awg_base
 {
 public:
+    //! device time (s) that corresponds to a sequence start time of 0
+    static constexpr unsigned int TIME_OFFSET = (1U << 20);
+
     host_awg(const std::string& address, const std::atomic<bool>& stop);
     bool load_program(std::unique_ptr<sequencer_data> seq) override;
     bool initialize() override;
     bool start() override;
+    bool swap_program(std::unique_ptr<sequencer_data> seq) override;
+
+    //! \brief Asynchronous TX event counters per channel; may be read while running
+    const std::map<size_t, tx_event_counters>& tx_events() const
+    {
+        return event_counters;
+    }
+
+    nlohmann::json statistics() const override;
 
     virtual ~host_awg();
 
+protected:
+    //! \brief Create a streamer; overload to stream to something other than a USRP
+    virtual std::shared_ptr<uhd::tx_streamer> make_tx_stream(
+        const uhd::stream_args_t& stream_args);
+    //! \brief Current device time in seconds
+    virtual double device_time();
+
+    double sampling_rate;
+    //! settings of the first program, which swapped-in programs keep
+    device_settings settings;
+    //! the first program; not valid any more once a swap was posted
+    sequencer_data* seq_data = nullptr;
+
 private:
     void setup_clocking();
     void sync_dance();
+    void preconvert_segments(sequencer_data& data, segment_store& segments);
+    void build_aligned_state();
+    void run_workers(
+        std::vector<std::tuple<std::string, std::function<void()>>>&& jobs);
+    void join_workers();
 
-    double sampling_rate;
     std::shared_ptr<uhd::usrp::multi_usrp> usrp;
-    std::unique_ptr<sequencer_data> seq_data;
 
-    std::vector<char> buffer;
+    //! held like every swapped-in program, so that the first swap retires it
+    std::shared_ptr<const loaded_program> first_program;
     std::unordered_map<size_t, sequencer_state> sequence_workers;
+    aligned_sequencer_state aligned_worker;
+    std::vector<std::thread> worker_threads;
+    std::map<size_t, tx_event_counters> event_counters;
+    std::map<size_t, stream_timing> stream_timings;
+    std::map<size_t, swap_slot> swap_slots;
+    std::unique_ptr<program_reaper> reaper;
+    //! per-channel workers are running, so swaps can be posted
+    std::atomic<bool> swappable{false};
+    device_clock clock;
+    std::vector<std::unique_ptr<tx_event_monitor>> monitors;
 };
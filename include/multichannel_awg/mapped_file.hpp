@@ -0,0 +1,59 @@
+/*
+ * Copyright 2023 Ettus Research, A National Instruments Brand
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+enum class prefault_e {
+    NONE,     //!< pages are read on first access
+    WILLNEED, //!< kernel starts reading the file ahead in the background
+    POPULATE  //!< the whole file is read before the mapping is returned
+};
+
+/*!
+ * \brief Read-only memory mapping of a whole file
+ *
+ * Move-only; unmaps (and unlocks) on destruction.
+ */
+class mapped_file
+{
+public:
+    mapped_file() = default;
+    /*!
+     * \param read_once the mapping is read through once, e.g. to hash it; lets the
+     *                  kernel read ahead far and drop pages once they were read. Not
+     *                  for samples that are played (again) from the mapping.
+     */
+    mapped_file(
+        const std::string& filename, prefault_e prefault, bool lock, bool read_once = false);
+    mapped_file(mapped_file&& other) noexcept;
+    mapped_file& operator=(mapped_file&& other) noexcept;
+    mapped_file(const mapped_file&) = delete;
+    mapped_file& operator=(const mapped_file&) = delete;
+    ~mapped_file();
+
+    const char* data() const
+    {
+        return static_cast<const char*>(addr);
+    }
+    size_t size() const
+    {
+        return length;
+    }
+    bool locked() const
+    {
+        return is_locked;
+    }
+
+private:
+    void release();
+
+    void* addr     = nullptr;
+    size_t length  = 0;
+    bool is_locked = false;
+};
@@ -31,6 +31,18 @@ public:
     //!\brief Overload this method; this starts the transmitter
     virtual bool start() = 0;
 
+    /*!
+     * \brief Replace the running program by seq without re-initializing the hardware
+     *
+     * Loads seq while the current program keeps playing, then switches every channel
+     * over at a repetition boundary. May be called from any thread while running.
+     * The default implementation doesn't support this and returns false.
+     */
+    virtual bool swap_program(std::unique_ptr<sequencer_data> seq);
+
+    //!\brief Runtime statistics as JSON; may be called from any thread while running
+    virtual nlohmann::json statistics() const;
+
     virtual ~awg_base();
 
 protected:
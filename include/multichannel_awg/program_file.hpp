@@ -0,0 +1,96 @@
+/*
+ * Copyright 2023 Ettus Research, A National Instruments Brand
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+#pragma once
+
+#include "sequence.hpp"
+#include <cstdint>
+#include <memory>
+#include <string>
+
+/*!
+ * \brief Header of a precompiled program file
+ *
+ * A program file holds everything sequencer_data is built from, in a form that needs no
+ * parsing: the "config" section (as JSON text; it is small), a table of segments and the
+ * per-channel timelines as arrays of fixed-size records. The timelines are used straight
+ * from the mapped file. The file is in host byte order and only valid for the build
+ * that wrote it; the header's version, byte order mark and record size catch mismatches.
+ *
+ * Layout: header, then config text, string table, segment records, channel records, block
+ * records and timeline_entry records, each section 8-byte aligned. Loop bodies (blocks)
+ * are stored like channels; their entries follow the channels' entries.
+ */
+struct program_file_header
+{
+    static constexpr char MAGIC[8]            = {'M', 'C', 'A', 'W', 'G', 'P', 'R', 'G'};
+    static constexpr uint32_t VERSION         = 3;
+    static constexpr uint32_t BYTE_ORDER_MARK = 0x01020304;
+
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t entry_size;
+    uint32_t reserved;
+    uint64_t config_offset;
+    uint64_t config_size;
+    uint64_t strings_offset;
+    uint64_t strings_size;
+    uint64_t segments_offset;
+    uint64_t num_segments;
+    uint64_t channels_offset;
+    uint64_t num_channels;
+    uint64_t blocks_offset;
+    uint64_t num_blocks;
+    uint64_t entries_offset;
+    uint64_t num_entries;
+};
+
+//! one segment; index in the table is the timeline's segment index
+struct program_file_segment
+{
+    static constexpr uint32_t NO_BASE = UINT32_MAX;
+
+    uint64_t length;
+    //! size of the sample file when compiled, to detect changed files
+    uint64_t file_size;
+    //! name and filename, as offsets and sizes into the string table
+    uint32_t name_offset;
+    uint32_t name_size;
+    uint32_t filename_offset;
+    uint32_t filename_size;
+    uint32_t streamed;
+    //! derived segments (see segment_derivation): index of the base, or NO_BASE
+    uint32_t base;
+    uint64_t offset;
+    double frequency;
+    double phase;
+    float gain;
+    uint32_t reserved;
+};
+
+//! a channel's timeline, or a block (then channel is the block index)
+struct program_file_channel
+{
+    uint64_t channel;
+    //! index of the channel's first timeline_entry record
+    uint64_t first_entry;
+    uint64_t num_entries;
+};
+
+//! \brief true if filename starts like a program file
+bool is_program_file(const std::string& filename);
+
+//! \brief Write data's compiled program to filename
+void write_program_file(const sequencer_data& data, const std::string& filename);
+
+/*!
+ * \brief Map a program file
+ *
+ * Throws std::runtime_error if the file isn't a valid program file of this version, or
+ * if a segment's sample file changed size since it was compiled.
+ */
+std::unique_ptr<sequencer_data> load_program_file(const std::string& filename);
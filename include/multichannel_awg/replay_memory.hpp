@@ -0,0 +1,100 @@
+/*
+ * Copyright 2023 Ettus Research, A National Instruments Brand
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+#pragma once
+
+#include "sequence.hpp"
+#include <nlohmann/json.hpp>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+//! A segment's samples in a Replay block's memory
+struct replay_allocation
+{
+    //! segment whose samples are stored here
+    const segment_spec* segment;
+    //! in bytes; a multiple of the memory word size
+    uint64_t address;
+    //! samples in the wire format, in bytes
+    uint64_t size;
+    //! bytes after the samples, up to the next word boundary
+    uint64_t padding;
+};
+
+/*!
+ * \brief Lays out segments in one Replay block's memory
+ *
+ * Every segment starts at a word-aligned address and takes its length in wire format
+ * bytes, rounded up to whole words. Slices (and deduplicated segments) share their
+ * base's memory, unless their offset into it isn't word aligned; then they get a copy
+ * of their own.
+ */
+class replay_memory
+{
+public:
+    /*!
+     * \param name Replay block, for messages
+     * \param mem_size bytes of memory available
+     * \param word_size bytes per memory word
+     * \param wire_itemsize bytes per sample in the wire format
+     */
+    replay_memory(std::string name, uint64_t mem_size, uint64_t word_size, size_t wire_itemsize);
+
+    /*!
+     * \brief Place segments (and the bases of slices among them)
+     *
+     * Segments that are already placed are skipped. Throws uhd::value_error if a
+     * segment can't be played from word-aligned memory, and uhd::runtime_error if the
+     * segments don't fit.
+     */
+    void allocate(const std::vector<const segment_spec*>& segments,
+        const sequencer_data::filemap_t& filemap);
+
+    //! \brief address of seg's first sample; throws uhd::lookup_error if not placed
+    uint64_t address(const segment_spec& seg) const;
+
+    //! in the order of their addresses
+    const std::vector<replay_allocation>& allocations() const
+    {
+        return placed;
+    }
+
+    //! bytes from address 0 to the end of the last allocation
+    uint64_t used() const;
+
+    /*!
+     * \brief Describes what the memory holds once the segments are recorded
+     *
+     * Layout, formats and a hash of every stored segment's samples, hashed in parallel;
+     * equal descriptions mean equal memory contents.
+     *
+     * \param scale factor that fc32 samples are converted to sc16 with
+     */
+    nlohmann::json describe(float scale) const;
+
+    //! \brief Prints how much memory is used, wasted by alignment and still free
+    void print_report() const;
+
+    const std::string name;
+    const uint64_t mem_size;
+    const uint64_t word_size;
+
+private:
+    //! \brief rounds bytes up to whole words
+    uint64_t align(uint64_t bytes) const
+    {
+        return (bytes + word_size - 1) / word_size * word_size;
+    }
+
+    const size_t wire_itemsize;
+    std::vector<replay_allocation> placed;
+    std::unordered_map<const segment_spec*, uint64_t> addresses;
+    //! segments sharing another one's memory
+    size_t shared = 0;
+};
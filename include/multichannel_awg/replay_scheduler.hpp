@@ -0,0 +1,139 @@
+/*
+ * Copyright 2023 Ettus Research, A National Instruments Brand
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+#pragma once
+
+#include "timeline.hpp"
+#include <uhd/types/stream_cmd.hpp>
+#include <uhd/types/time_spec.hpp>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+//! One Replay play command
+struct replay_command
+{
+    //! segment entry this command plays (part of), loops expanded
+    timeline_entry entry{};
+    //! first sample, in ticks of the sampling rate
+    uint64_t sample_tick;
+    uint64_t num_samps;
+    //! radio clock tick at which playing starts, relative to the start offset
+    uint64_t radio_tick;
+    uhd::stream_cmd_t::stream_mode_t mode;
+};
+
+class replay_command_source;
+
+/*!
+ * \brief Schedules a channel's timeline as Replay commands without drifting
+ *
+ * All times are kept as integer ticks. Radio ticks are derived from sample ticks by
+ * exact rational scaling, and only turned into a uhd::time_spec_t when a command is
+ * issued, so no error accumulates over long chains of repetitions.
+ */
+class replay_scheduler
+{
+public:
+    /*!
+     * \param sampling_rate rate at which the Replay block plays samples
+     * \param radio_rate rate of the radio clock that commands are timed in
+     * \param start_offset device time (s) that corresponds to sample tick 0
+     */
+    replay_scheduler(double sampling_rate, double radio_rate, double start_offset);
+
+    //! \brief radio tick at which sample_tick is due, relative to the start offset
+    uint64_t radio_tick(uint64_t sample_tick) const;
+
+    //! \brief true if every sample boundary falls on a radio tick
+    bool exact() const
+    {
+        return den == 1;
+    }
+
+    uhd::time_spec_t time_spec(const replay_command& cmd) const;
+
+    /*!
+     * \brief Checks the commands of source as they would be issued
+     *
+     * Each command's time_spec must convert back to exactly its radio tick, and a
+     * command that continues the previous one must start exactly where that one ends.
+     * Prints up to max_reports violations. Give it a source with a bounded number of
+     * loop passes (VERIFIED_PASSES); an endless loop never runs out of commands.
+     *
+     * \return number of violations
+     */
+    size_t verify(size_t channel, replay_command_source source, size_t max_reports = 10) const;
+
+    //! loop passes that verify() needs: the first, and the boundary to the next one
+    static constexpr uint64_t VERIFIED_PASSES = 2;
+
+private:
+    double radio_rate;
+    //! radio ticks per sample is num / den, in lowest terms
+    uint64_t num;
+    uint64_t den;
+    long long offset_ticks;
+};
+
+/*!
+ * \brief Schedules a timeline as Replay commands, one command at a time
+ *
+ * The Replay block wraps around within the play buffer, which holds one repetition,
+ * so all repetitions of a segment are one command, unless they are more than
+ * max_samps samples; an endless segment is a continuous command. Loops are expanded
+ * as commands are taken, so a program's schedule is never held in memory as a whole.
+ * The scheduler, program and timeline must outlive the source.
+ */
+class replay_command_source
+{
+public:
+    replay_command_source() = default;
+    /*!
+     * \param last whether these are the channel's last commands; if so, the final one
+     *             ends the stream
+     * \param max_samps most samples per command; repetitions are split into several
+     *                  commands (at repetition boundaries) only beyond this
+     * \param max_passes most passes of each loop to schedule (see timeline_cursor)
+     */
+    replay_command_source(const replay_scheduler& scheduler,
+        const compiled_program& program,
+        std::span<const timeline_entry> timeline,
+        bool last           = true,
+        uint64_t max_samps  = UINT64_MAX,
+        uint64_t max_passes = UINT64_MAX);
+
+    //! \brief Next command in issue order; false once the timeline is exhausted
+    bool next(replay_command& cmd);
+
+    //! \brief true if next() has no more commands
+    bool empty() const
+    {
+        return !has_lookahead;
+    }
+
+    //! \brief true if loop passes beyond max_passes were left out
+    bool truncated() const
+    {
+        return cursor.truncated();
+    }
+
+private:
+    //! \brief next command, before the last one is turned into the end of the stream
+    bool expand(replay_command& cmd);
+
+    const replay_scheduler* scheduler = nullptr;
+    timeline_cursor cursor;
+    //! entry being expanded, and its repetitions issued so far
+    timeline_entry entry{};
+    uint64_t rep = 0;
+    uint64_t max_samps = UINT64_MAX;
+    bool has_entry = false;
+    bool last      = true;
+    //! taken from expand() one command early, to know which command is the last one
+    replay_command lookahead{};
+    bool has_lookahead = false;
+};
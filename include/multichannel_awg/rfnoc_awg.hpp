@@ -7,6 +7,9 @@
 #pragma once
 
 #include "multichannel_awg.hpp"
+#include "replay_memory.hpp"
+#include "replay_scheduler.hpp"
+#include "segment_store.hpp"
 #include "sequence.hpp"
 #include <uhd/rfnoc_graph.hpp>
 #include <uhd/rfnoc/block_id.hpp>
@@ -14,7 +17,9 @@
 #include <uhd/rfnoc/mb_controller.hpp>
 #include <uhd/rfnoc/radio_control.hpp>
 #include <uhd/rfnoc/replay_block_control.hpp>
+#include <map>
 #include <memory>
+#include <span>
 #include <string>
 #include <tuple>
 #include <utility>
@@ -24,8 +29,16 @@
 class rfnoc_awg : virtual public awg_base
 {
 public:
-    static constexpr size_t MAX_NUM_SEQ_POINTS = 32;
+    //! commands printed per channel; later ones are issued silently
+    static constexpr size_t MAX_PRINTED_COMMANDS = 32;
+    //! chunks sent to a Replay block ahead of what it has recorded
+    static constexpr size_t UPLOAD_CHUNKS_IN_FLIGHT = 4;
+    //! shortest wait (s) between checks of a full command FIFO
+    static constexpr double MIN_POLL_INTERVAL = 100e-6;
     static constexpr double START_TIME_OFFSET = 1.0;
+    //! a live channel holds back its last command, in case it ends the stream, until
+    //! this long (s) before it starts
+    static constexpr double LIVE_HOLD_MARGIN = 0.1;
 
     rfnoc_awg(const std::string& address, const std::atomic<bool>& stop);
     bool load_program(std::unique_ptr<sequencer_data> seq) override;
@@ -42,23 +55,48 @@ private:
         size_t radio_port;
         std::shared_ptr<uhd::tx_streamer> tx_stream;
         std::shared_ptr<uhd::rfnoc::replay_block_control> replay_ctrl;
+        //! nullptr if the Replay block feeds the radio directly
         std::shared_ptr<uhd::rfnoc::duc_block_control> duc_ctrl;
         std::shared_ptr<uhd::rfnoc::radio_control> radio_ctrl;
+        //! layout of the Replay block's memory; shared by all its ports
+        replay_memory* memory = nullptr;
     };
 
     void create_graph();
     void validate();
+    /*!
+     * \brief Replay→(DUC→)Radio chains of the FPGA image, ordered by radio and port
+     *
+     * Found from the image's static connections: the radio inputs that a DUC, a Replay
+     * block or a stream endpoint feeds. Chains that aren't hardwired to a Replay block
+     * get the remaining Replay outputs of their device, in order.
+     */
+    std::vector<rfnoc_chain> discover_chains();
     void connect_graph();
+    void allocate_memory();
     void config_rfnoc_blocks();
+    //! \brief uploads replay_graph's Replay block's segments, unless it still holds them
+    void load_replay_block(const replay_graph_config& replay_graph);
+    //! \brief records the segments of replay_graph's Replay block into its memory
+    void upload_segments(const replay_graph_config& replay_graph);
     void setup_clocking();
     void sync_dance();
     void transmit_sequences();
+    //! \brief commands for timeline, as long as the Replay block can play them
+    replay_command_source make_source(const replay_scheduler& scheduler, std::span<const timeline_entry> timeline, bool last, uint64_t max_passes = UINT64_MAX) const;
+    //! \brief configures the play buffer if it differs from configured, and issues cmd
+    void issue_command(size_t channel, const replay_scheduler& scheduler, const replay_command& cmd, std::pair<uint64_t, uint64_t>& configured, bool print);
+    //! \brief issues source's commands, and then the sequence input's, as the channel's
+    //! command FIFO has space for them; returns when done or stopped
+    void feed_channel(size_t channel, const replay_scheduler& scheduler, replay_command_source source);
 
     double sampling_rate;
     std::unique_ptr<sequencer_data> seq_data;
     std::shared_ptr<uhd::rfnoc::rfnoc_graph> graph;
     std::unordered_map<size_t, replay_graph_config> replay_graphs;
+    //! by Replay block ID
+    std::map<std::string, replay_memory> replay_memories;
 
-    std::vector<char> buffer;
+    segment_store store;
 
 };
@@ -0,0 +1,96 @@
+/*
+ * Copyright 2023 Ettus Research, A National Instruments Brand
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+#pragma once
+
+#include "sequence.hpp"
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*!
+ * \brief Reads a segment from disk ahead of playback into a small ring of blocks
+ *
+ * A pool of pread() workers fills a bounded set of reusable, page-aligned blocks while
+ * the consumer sends the blocks that are already complete. Repetitions are read as one
+ * continuous stream, so the start of the next repetition is in flight while the end of
+ * the current one is still being sent. Memory use is num_blocks × block_size, however
+ * long the segment. With preconversion, every block also has an sc16 copy, half its size.
+ */
+class segment_reader
+{
+public:
+    static constexpr uint64_t FOREVER = UINT64_MAX;
+
+    struct block
+    {
+        const char* data;
+        //! number of samples in this block
+        size_t length;
+    };
+
+    /*!
+     * \param sspec the (streamed) segment to read
+     * \param plays number of times to read the segment, or FOREVER
+     * \param settings block size, block count, reader threads and direct I/O
+     * \param itemsize size of a sample in the file
+     * \param preconvert if enabled, blocks are converted fc32 → sc16 by the readers
+     */
+    segment_reader(const segment_spec& sspec,
+        uint64_t plays,
+        const loading_settings& settings,
+        size_t itemsize,
+        const preconvert_settings& preconvert);
+    ~segment_reader();
+    segment_reader(const segment_reader&) = delete;
+    segment_reader& operator=(const segment_reader&) = delete;
+
+    /*!
+     * \brief Wait for the next block in order
+     *
+     * \return false at the end of the last play, or if stop was set
+     */
+    bool next(block& blk, const std::atomic<bool>& stop);
+
+    //! \brief Hand the block returned by the last next() back for reuse
+    void release();
+
+private:
+    struct slot
+    {
+        char* data = nullptr;
+        //! block converted to sc16, with preconversion
+        int16_t* converted = nullptr;
+        size_t length;
+        //! stream block index the slot currently holds, if ready
+        uint64_t ready_index = UINT64_MAX;
+    };
+
+    void work();
+
+    int fd = -1;
+    std::string filename;
+    size_t block_size;
+    size_t file_blocks;
+    size_t file_size;
+    size_t itemsize;
+    uint64_t total_blocks;
+    preconvert_settings preconvert;
+
+    std::vector<slot> slots;
+    std::mutex mutex;
+    std::condition_variable slot_ready;
+    std::condition_variable slot_free;
+    uint64_t next_to_issue   = 0;
+    uint64_t next_to_consume = 0;
+    bool shutdown            = false;
+    std::vector<std::thread> workers;
+};
@@ -0,0 +1,100 @@
+/*
+ * Copyright 2023 Ettus Research, A National Instruments Brand
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+#pragma once
+
+#include "mapped_file.hpp"
+#include "sequence.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+//! \brief 64 bit hash of size bytes of data; fast, but not cryptographic
+uint64_t content_hash(const char* data, size_t size);
+
+/*!
+ * \brief Holds the sample data of all segments of a program in host memory
+ *
+ * Shared by the host and RFNoC backends. Segment files are read (or mapped) in parallel,
+ * each into its precomputed place in the store, and every segment_spec's data and
+ * start_idx are pointed at its samples. Streamed segments are skipped; they are read
+ * while playing. Derived segments are computed from their base once it's loaded; slices
+ * take no space of their own, their data points into their base's samples.
+ *
+ * Segments that aren't referenced aren't loaded. Files that are identical to another
+ * segment's, by path or by content, are loaded once: the duplicate segment becomes a
+ * slice of the first one.
+ */
+class segment_store
+{
+public:
+    struct file_stats
+    {
+        std::string segment;
+        std::string filename;
+        size_t bytes;
+        double seconds;
+    };
+
+    /*!
+     * \brief Load every non-streamed segment in filemap, and derive the derived ones;
+     * reports throughput
+     *
+     * Derived sc16 samples that clip are saturated and reported.
+     */
+    void load(sequencer_data::filemap_t& filemap, const loading_settings& settings);
+
+    /*!
+     * \brief Replace all loaded fc32 segments by sc16 copies
+     *
+     * Throws uhd::value_error if a segment clips and settings.saturate is false, or if
+     * a streamed fc32 segment is played then, as it can only be converted while playing.
+     */
+    void convert_to_sc16(
+        sequencer_data::filemap_t& filemap, const preconvert_settings& settings);
+
+    /*!
+     * \brief Free all segment data, e.g. once it has been copied to the device
+     *
+     * Clears the data of every segment in filemap that isn't streamed.
+     */
+    void release(sequencer_data::filemap_t& filemap);
+
+    //! combined size of all loaded and derived segments in bytes
+    size_t size() const
+    {
+        return total_size;
+    }
+
+    const std::vector<file_stats>& stats() const
+    {
+        return load_stats;
+    }
+
+private:
+    /*!
+     * \brief turn segments whose file is the same as another's into slices of it
+     *
+     * Files of equal size are screened by a hash of both their ends; only those that
+     * pass are read completely. Files are read by up to num_threads threads.
+     */
+    static void deduplicate(sequencer_data::filemap_t& filemap, size_t num_threads);
+    //! \brief compute every derived segment (but slices) into its place in targets
+    void derive(sequencer_data::filemap_t& filemap,
+        const std::unordered_map<const segment_spec*, char*>& targets);
+    //! \brief point every slice's data and start_idx into its base
+    static void point_views(sequencer_data::filemap_t& filemap);
+
+    //! segment data, unless segments are memory mapped
+    std::vector<char> buffer;
+    //! samples of derived segments, while segments are memory mapped
+    std::vector<char> derived;
+    std::vector<mapped_file> mappings;
+    size_t total_size = 0;
+    std::vector<file_stats> load_stats;
+};
@@ -6,11 +6,17 @@
  */
 #pragma once
 
+#include "mapped_file.hpp"
+#include "timeline.hpp"
 #include <uhd/types/stream_cmd.hpp>
 #include <nlohmann/json.hpp>
+#include <map>
+#include <memory>
+#include <optional>
 #include <string>
 #include <tuple>
 #include <unordered_map>
+#include <vector>
 
 struct timed_stream_cmd
 {
@@ -19,21 +25,63 @@ struct timed_stream_cmd
     uhd::stream_cmd_t command;
 };
 
+//! How a derived segment is computed from its base segment
+struct segment_derivation
+{
+    std::string base;
+    //! first sample of base that is used
+    size_t offset = 0;
+    float gain = 1.0f;
+    //! complex frequency shift, in cycles per sample
+    double frequency = 0.0;
+    //! in radians
+    double phase = 0.0;
+
+    //! \brief a plain sub-range of base, which needs no samples of its own
+    bool is_slice() const
+    {
+        return gain == 1.0f && frequency == 0.0 && phase == 0.0;
+    }
+};
+
 struct segment_spec
 {
     std::string name;
     std::string filename;
     size_t length;
+    //! bytes per sample in data
+    size_t itemsize;
     size_t start_idx;
-    char* data;
+    const char* data;
+    //! read from disk while playing instead of being loaded up front (host mode only)
+    bool streamed = false;
+    //! set if computed from another segment instead of read from filename
+    std::optional<segment_derivation> derived;
+    //! played by the program, or the base of a segment that is; others aren't loaded
+    bool referenced = true;
+
+    //! \brief a slice: data points into its base segment's samples
+    bool is_view() const
+    {
+        return derived && derived->is_slice();
+    }
 };
 
+struct sequence_point;
+//! items of a loop, played back to back
+using sequence_body = std::vector<sequence_point>;
+
 struct sequence_point
 {
     size_t channel;
     double start_time;
     int repetitions = 0;
     std::string segment;
+    //! if set, this loop body is played instead of a segment; shared by all uses of a
+    //! named pattern
+    std::shared_ptr<const sequence_body> body;
+    //! in a loop body: silence before this item, in seconds
+    double gap = 0.0;
 };
 
 enum class clock_source_e { INTERNAL, EXTERNAL };
@@ -44,6 +92,112 @@ enum class dataformat_e {
     CPU_DEFAULT  = FC_32
 };
 
+//! Settings for the host-side streaming threads
+struct streaming_settings
+{
+    //! CPU core to pin each channel's streaming thread to, in ascending channel order.
+    //! Channels beyond the end of this list are not pinned.
+    std::vector<size_t> cpu_affinity;
+    //! UHD thread priority (0.0 … 1.0) of the streaming threads
+    float thread_priority = 0.0f;
+    //! Whether to request a real-time scheduling class for the streaming threads
+    bool realtime = false;
+    //! Stream all channels through one multi-channel streamer instead of one per channel
+    bool aligned = false;
+};
+
+//! Settings for converting segments to the wire format once, at load time
+struct preconvert_settings
+{
+    bool enabled = false;
+    //! factor applied to fc32 samples before rounding to sc16
+    float scale = 32767.0f;
+    //! clamp out-of-range samples; if false, a segment that would clip fails to load
+    bool saturate = true;
+};
+
+//! Settings for reading segment files
+struct loading_settings
+{
+    //! map the sample files instead of reading them into one buffer
+    bool mmap = true;
+    prefault_e prefault = prefault_e::WILLNEED;
+    //! keep mapped segments resident in RAM
+    bool mlock = false;
+    //! number of files loaded concurrently; 0: one per hardware thread
+    size_t load_threads = 0;
+
+    // Streamed segments
+    //! size of one read-ahead block in bytes
+    size_t stream_block_size = 4 << 20;
+    //! number of read-ahead blocks per streamed segment
+    size_t stream_blocks = 8;
+    //! number of concurrent pread() workers per streamed segment
+    size_t stream_readers = 2;
+    //! bypass the page cache (O_DIRECT) when streaming segments
+    bool direct_io = false;
+};
+
+//! Settings for the simulated device ("sim" mode)
+struct sim_settings
+{
+    //! link throughput in bytes/s; 0: unlimited
+    double link_rate = 0.0;
+    //! device-side buffer per channel, in samples
+    size_t buffer_samples = 65536;
+    //! samples per packet
+    size_t max_samps = 2000;
+    //! file to write each channel's samples to; other channels discard theirs
+    std::map<size_t, std::string> sinks;
+};
+
+//! Settings for sequence points that arrive while running (--stream)
+struct live_settings
+{
+    //! timeline entries buffered per channel before the input blocks
+    size_t queue_size = 1024;
+};
+
+//! Settings for swapping in a changed program while running (SIGHUP)
+struct swap_settings
+{
+    //! reload the program on SIGHUP; channels wait for a new program when theirs ends
+    bool enabled = false;
+    //! seconds from a new program being loaded until it starts playing
+    double lead_time = 0.5;
+};
+
+//! The RFNoC blocks (and their ports) that play one channel
+struct rfnoc_chain
+{
+    std::string replay;
+    size_t replay_port = 0;
+    //! empty if the Replay block feeds the radio without a DUC
+    std::string duc;
+    size_t duc_port = 0;
+    std::string radio;
+    size_t radio_port = 0;
+};
+
+//! Settings for RFNoC mode
+struct rfnoc_settings
+{
+    //! blocks of these channels, instead of the ones found in the FPGA image
+    std::map<size_t, rfnoc_chain> channels;
+    //! check the Replay command schedule for gaps and rounding before issuing it
+    bool verify_schedule = false;
+    //! longest wait (s) between checks of a full Replay command FIFO
+    double poll_interval = 0.01;
+    //! bytes of sc16 samples converted and sent to the Replay block at a time
+    size_t upload_chunk_size = 4 << 20;
+    //! seconds without upload progress after which loading the Replay block fails
+    double upload_timeout = 5.0;
+    //! skip the upload if the manifest shows the Replay memory already holds the segments
+    bool reuse_memory = false;
+    //! where manifests of uploads are kept; empty: the user's cache directory
+    std::string manifest_dir;
+};
+
 struct device_settings
 {
     // Types for clarity purposes
@@ -61,17 +215,84 @@ struct device_settings
     dataformat_e cpu_format;
     dataformat_e wire_format;
     size_t itemsize;
+    streaming_settings streaming;
+    preconvert_settings preconvert;
+    loading_settings loading;
+    sim_settings sim;
+    rfnoc_settings rfnoc;
+    live_settings live;
+    swap_settings swap;
 };
 
+//! UHD format string ("sc16", "fc32") for a data format
+std::string format_name(dataformat_e format);
+
 void from_json(const nlohmann::json& j, sequence_point& sp);
+void from_json(const nlohmann::json& j, streaming_settings& ss);
+void from_json(const nlohmann::json& j, preconvert_settings& ps);
+void from_json(const nlohmann::json& j, loading_settings& ls);
+void from_json(const nlohmann::json& j, sim_settings& ss);
+void from_json(const nlohmann::json& j, rfnoc_chain& rc);
+void from_json(const nlohmann::json& j, rfnoc_settings& rs);
+void from_json(const nlohmann::json& j, live_settings& ls);
+void from_json(const nlohmann::json& j, swap_settings& ss);
 void from_json(const nlohmann::json& j, device_settings& ds);
 
+/*!
+ * \brief Findings of sequence validation
+ *
+ * Counts every finding, but keeps only the first MAX_MESSAGES messages, so that huge
+ * generated programs don't flood the console.
+ */
+struct validation_report
+{
+    static constexpr size_t MAX_MESSAGES = 20;
+
+    //! points delayed because they overlapped the previous one on their channel
+    size_t adjusted = 0;
+    //! points after an endless loop
+    size_t unreachable = 0;
+    //! points referring to a segment that isn't defined
+    size_t unknown_segment = 0;
+    //! input that isn't a usable sequence point
+    size_t invalid = 0;
+    std::vector<std::string> messages;
+    //! messages dropped because MAX_MESSAGES were already kept
+    size_t suppressed = 0;
+
+    size_t total() const
+    {
+        return adjusted + unreachable + unknown_segment + invalid;
+    }
+    void add_message(std::string message);
+    //! \brief appends other's counts and (bounded) messages
+    void merge(const validation_report& other);
+    void print() const;
+};
+
 struct sequencer_data
 {
     using filemap_t = std::unordered_map<std::string, segment_spec>;
     std::unordered_map<size_t, std::vector<sequence_point>> used_channels;
     sequencer_data(const nlohmann::json& data);
-    nlohmann::json def;
+    //! \brief empty program; used when loading precompiled programs
+    sequencer_data(const nlohmann::json& config, device_settings settings);
+    //! the "config" section, as given
+    nlohmann::json config;
     device_settings settings;
     filemap_t filemap;
+    //! what the backends play; points into filemap
+    compiled_program program;
+    validation_report report;
+
+    /*!
+     * \brief Set segment_spec::referenced from what program plays
+     *
+     * Every segment stays referenced if sequence points may still arrive while running.
+     */
+    void mark_referenced();
+
+private:
+    //! \brief sorts every channel by start time and checks it; channels in parallel
+    void validate();
 };
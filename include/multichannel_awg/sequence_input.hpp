@@ -0,0 +1,60 @@
+/*
+ * Copyright 2023 Ettus Research, A National Instruments Brand
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+#pragma once
+
+#include "sequence.hpp"
+#include "timeline.hpp"
+#include <nlohmann/json.hpp>
+#include <atomic>
+#include <cstddef>
+#include <map>
+#include <memory>
+#include <string>
+
+/*!
+ * \brief Reads a program as newline-delimited JSON, while it plays
+ *
+ * The first line is a header object with the "config" and "segments" sections, and
+ * optionally an initial "sequence" and a list of "channels" that points may be sent for
+ * later. Every following line holds one sequence point. Points are validated as they
+ * arrive and appended to their channel's live queue; when a queue is full, reading
+ * blocks until the backend catches up.
+ */
+class sequence_input
+{
+public:
+    //! \brief Reads the header from fd (not owned)
+    sequence_input(int fd, const std::atomic<bool>& stop);
+
+    const nlohmann::json& header() const
+    {
+        return header_json;
+    }
+
+    //! \brief Sets up data's live queues; call before handing data to a backend
+    void attach(sequencer_data& data);
+
+    //! \brief Feeds sequence points until the input ends or stop is set, then closes
+    //! the queues
+    void run();
+
+private:
+    //! \brief next line of input; false at its end or on stop
+    bool read_line(std::string& line);
+
+    const int fd;
+    const std::atomic<bool>& stop;
+    nlohmann::json header_json;
+    std::string buffer;
+    //! start of the unread part of buffer
+    size_t read_pos   = 0;
+    bool end_of_input = false;
+
+    std::unique_ptr<timeline_builder> builder;
+    std::map<size_t, std::shared_ptr<timeline_queue>> queues;
+    validation_report report;
+};
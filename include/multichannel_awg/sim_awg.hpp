@@ -0,0 +1,40 @@
+/*
+ * Copyright 2023 Ettus Research, A National Instruments Brand
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+#pragma once
+
+#include "host_awg.hpp"
+#include "sim_device.hpp"
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+/*!
+ * \brief Host-mode AWG streaming into a simulated device instead of a USRP
+ *
+ * Runs the complete host pipeline (loading, conversion, sequencing, threading, event
+ * monitoring) against sim_tx_streamer, so it can be tested and benchmarked without
+ * hardware. Configured by the "sim" object of the config section.
+ */
+class sim_awg : public host_awg
+{
+public:
+    sim_awg(const std::string& address, const std::atomic<bool>& stop);
+    bool initialize() override;
+    bool start() override;
+
+    virtual ~sim_awg();
+
+protected:
+    std::shared_ptr<uhd::tx_streamer> make_tx_stream(
+        const uhd::stream_args_t& stream_args) override;
+    double device_time() override;
+
+private:
+    sim_timekeeper timekeeper;
+    std::vector<std::shared_ptr<sim_tx_streamer>> streamers;
+};
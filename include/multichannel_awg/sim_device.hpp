@@ -0,0 +1,99 @@
+/*
+ * Copyright 2023 Ettus Research, A National Instruments Brand
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+#pragma once
+
+#include "sequence.hpp"
+#include <uhd/stream.hpp>
+#include <uhd/types/metadata.hpp>
+#include <uhd/version.hpp>
+#if UHD_VERSION >= 4050000
+#    include <uhd/rfnoc/actions.hpp>
+#endif
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+/*!
+ * \brief Device time for the simulated device, derived from the host's steady clock
+ */
+class sim_timekeeper
+{
+public:
+    double time_now() const;
+    void set_time_now(double time);
+
+private:
+    std::chrono::steady_clock::time_point host_ref = std::chrono::steady_clock::now();
+    double device_ref                              = 0.0;
+};
+
+/*!
+ * \brief In-process stand-in for a USRP's TX streamer
+ *
+ * Behaves like the device side of a TX stream: it holds a buffer of buffer_samples per
+ * channel that drains at the sampling rate from the start of each timed burst, applies
+ * flow control when that buffer is full, and throttles to the configured link rate.
+ * Late bursts, underflows and burst ACKs are reported through recv_async_msg().
+ * Samples are discarded or written to a file, per channel.
+ */
+class sim_tx_streamer : public uhd::tx_streamer
+{
+public:
+    sim_tx_streamer(const sim_timekeeper& timekeeper,
+        const std::vector<size_t>& channels,
+        size_t itemsize,
+        double sampling_rate,
+        const sim_settings& settings);
+
+    size_t get_num_channels() const override;
+    size_t get_max_num_samps() const override;
+    size_t send(const buffs_type& buffs,
+        const size_t nsamps_per_buff,
+        const uhd::tx_metadata_t& metadata,
+        const double timeout = 0.1) override;
+    bool recv_async_msg(uhd::async_metadata_t& async_metadata, double timeout = 0.1) override;
+#if UHD_VERSION >= 4050000
+    void post_output_action(
+        const std::shared_ptr<uhd::rfnoc::action_info>& action, const size_t port) override;
+#endif
+
+    //! samples accepted so far on each of the streamer's channels
+    uint64_t samples_sent() const
+    {
+        return total_samples.load();
+    }
+
+private:
+    void post_event(uhd::async_metadata_t::event_code_t code, double time);
+
+    const sim_timekeeper& timekeeper;
+    const size_t num_channels;
+    const size_t itemsize;
+    const double sampling_rate;
+    const sim_settings settings;
+    std::vector<std::unique_ptr<std::ofstream>> sinks;
+
+    bool in_burst = false;
+    //! device time at which the current burst started playing
+    double burst_start = 0.0;
+    //! device time at which the last sample sent so far will have been played
+    double play_until = 0.0;
+    //! host time at which the simulated link is free again
+    std::chrono::steady_clock::time_point link_free = std::chrono::steady_clock::now();
+    std::atomic<uint64_t> total_samples{0};
+
+    std::mutex async_mutex;
+    std::condition_variable async_cond;
+    std::deque<uhd::async_metadata_t> async_queue;
+};
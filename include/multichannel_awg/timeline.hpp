@@ -0,0 +1,217 @@
+/*
+ * Copyright 2023 Ettus Research, A National Instruments Brand
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+#pragma once
+
+#include "mapped_file.hpp"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+struct segment_spec;
+struct sequence_point;
+struct sequencer_data;
+using sequence_body = std::vector<sequence_point>;
+
+/*!
+ * \brief One sequence point, resolved to integer sample units
+ *
+ * Ticks count samples at the program's sampling rate, starting at program time 0.
+ * An entry either plays a segment, or a block (loop body) of further entries, whose
+ * start ticks are relative to the start of each pass through the block.
+ * This is also the record layout of precompiled program files.
+ */
+struct timeline_entry
+{
+    static constexpr uint64_t FOREVER  = 0;
+    static constexpr uint32_t NO_BLOCK = UINT32_MAX;
+
+    //! index into compiled_program::segments
+    uint32_t segment;
+    //! index into compiled_program::blocks, or NO_BLOCK to play the segment
+    uint32_t block;
+    //! first sample of the segment that is played
+    uint64_t sample_offset;
+    //! samples played per repetition (for blocks: ticks per pass)
+    uint64_t length;
+    //! tick of the first sample; never before the end of the previous entry
+    uint64_t start_tick;
+    //! number of times the segment (or block) is played, or FOREVER
+    uint64_t repeat_count;
+
+    //! \brief tick after the last sample of the last repetition; UINT64_MAX if forever
+    uint64_t end_tick() const
+    {
+        return repeat_count == FOREVER ? UINT64_MAX : start_tick + length * repeat_count;
+    }
+};
+static_assert(sizeof(timeline_entry) == 40, "timeline_entry is a file record");
+
+/*!
+ * \brief Bounded queue of timeline entries that are appended while the program plays
+ *
+ * Fed by the sequence input, drained by a backend's channel worker.
+ */
+class timeline_queue
+{
+public:
+    enum class status { ENTRY, TIMEOUT, CLOSED };
+
+    explicit timeline_queue(size_t capacity) : capacity(capacity) {}
+
+    //! \brief Appends entry, blocking while the queue is full; false if stopped first
+    bool push(const timeline_entry& entry, const std::atomic<bool>& stop);
+    //! \brief Takes the next entry, waiting at most timeout for one
+    status pop(timeline_entry& entry, std::chrono::milliseconds timeout);
+    //! \brief No more entries will be pushed; pop() returns CLOSED once drained
+    void close();
+
+private:
+    const size_t capacity;
+    std::mutex mutex;
+    std::condition_variable not_empty;
+    std::condition_variable not_full;
+    std::deque<timeline_entry> entries;
+    bool closed = false;
+};
+
+/*!
+ * \brief Immutable, per-channel timeline of a program
+ *
+ * Overlaps are resolved (an entry starts no earlier than the end of its predecessor),
+ * entries after an endless loop are dropped, and segment names are resolved to indices.
+ * Backends only read it, so a program can be played again without reloading.
+ */
+struct compiled_program
+{
+    double sampling_rate;
+    //! segments by index; point into sequencer_data::filemap
+    std::vector<const segment_spec*> segments;
+    //! entries of each channel, in playing order; point into entries or file
+    std::map<size_t, std::span<const timeline_entry>> channels;
+    //! loop bodies, referred to by timeline_entry::block; shared by all their uses
+    std::vector<std::span<const timeline_entry>> blocks;
+
+    //! storage of compiled entries
+    std::vector<timeline_entry> entries;
+    //! storage of entries mapped from a precompiled program file
+    mapped_file file;
+
+    //! channels whose timeline continues with entries from the sequence input
+    std::map<size_t, std::shared_ptr<timeline_queue>> live;
+};
+
+/*!
+ * \brief Turns sequence points into timeline entries, one at a time
+ *
+ * A point that would start before the end of its channel's previous entry is delayed;
+ * points after an endless loop are dropped. Channels continue where the program's
+ * timelines end.
+ */
+class timeline_builder
+{
+public:
+    enum class status {
+        ADDED,
+        //! added, but later than requested
+        DELAYED,
+        UNKNOWN_SEGMENT,
+        EMPTY_SEGMENT,
+        //! after an endless loop
+        UNREACHABLE
+    };
+
+    explicit timeline_builder(const compiled_program& program);
+
+    //! \brief Resolves sp; entry is only valid if ADDED or DELAYED is returned
+    status add(const sequence_point& sp, timeline_entry& entry);
+
+    //! entries of the blocks that add() compiled loop bodies into, one after another
+    std::vector<timeline_entry> block_entries;
+    //! (first, count) of each block in block_entries
+    std::vector<std::pair<size_t, size_t>> block_ranges;
+
+private:
+    //! \brief compiles body (once); returns its block index and ticks per pass, which
+    //! is 0 if nothing in it can be played
+    std::pair<uint32_t, uint64_t> compile_body(const sequence_body& body);
+
+    const compiled_program& program;
+    std::unordered_map<const sequence_body*, std::pair<uint32_t, uint64_t>> bodies;
+    std::unordered_map<std::string, uint32_t> index;
+    //! per channel: earliest start tick of the next entry; UINT64_MAX after a loop
+    std::unordered_map<size_t, uint64_t> earliest;
+};
+
+/*!
+ * \brief Walks a channel's timeline with all loops expanded
+ *
+ * Expansion is lazy: the cursor only keeps one position per nesting level.
+ */
+class timeline_cursor
+{
+public:
+    timeline_cursor() = default;
+    /*!
+     * \param max_passes most passes played of each loop, endless ones included; later
+     *                   passes only shift the earlier ones, so checking a schedule
+     *                   needs no more than two
+     */
+    timeline_cursor(const compiled_program& program,
+        std::span<const timeline_entry> timeline,
+        uint64_t max_passes = UINT64_MAX);
+
+    /*!
+     * \brief Next segment to play
+     *
+     * \param entry receives the segment entry, with its absolute start tick
+     * \return false at the end of the timeline
+     */
+    bool next(timeline_entry& entry);
+
+    //! \brief true once a loop was left before all its passes were played
+    bool truncated() const
+    {
+        return cut_short;
+    }
+
+private:
+    struct level
+    {
+        std::span<const timeline_entry> entries;
+        size_t index;
+        uint64_t pass;
+        uint64_t passes;
+        //! tick at which the first pass starts
+        uint64_t start_tick;
+        //! ticks per pass
+        uint64_t length;
+    };
+
+    const compiled_program* program = nullptr;
+    std::vector<level> levels;
+    uint64_t max_passes = UINT64_MAX;
+    bool cut_short      = false;
+};
+
+/*!
+ * \brief Compile the sequence of data into a timeline
+ *
+ * A sequence point with a negative repetition count loops forever; otherwise its
+ * segment is played max(repetitions, 1) times.
+ */
+compiled_program compile_program(const sequencer_data& data);
@@ -0,0 +1,89 @@
+/*
+ * Copyright 2023 Ettus Research, A National Instruments Brand
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+#pragma once
+
+#include <nlohmann/json_fwd.hpp>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <map>
+#include <memory>
+#include <thread>
+#include <vector>
+
+// fwd decl
+namespace uhd {
+class tx_streamer;
+} // namespace uhd
+
+/*!
+ * \brief Count of one kind of asynchronous TX event
+ *
+ * Written only by the monitor thread, so a plain store suffices for first_time; readers
+ * may query at any time without locking.
+ */
+struct tx_event_counter
+{
+    std::atomic<uint64_t> count{0};
+    //! device time (s) of the first occurrence; NaN if it came without a time, or if
+    //! there was none yet
+    std::atomic<double> first_time{std::numeric_limits<double>::quiet_NaN()};
+
+    //! \param time of the event, NaN if unknown
+    void record(double time);
+};
+
+struct tx_event_counters
+{
+    tx_event_counter underflow;
+    tx_event_counter seq_error;
+    tx_event_counter time_error;
+    tx_event_counter burst_ack;
+
+    //! \param time_offset subtracted from device times
+    nlohmann::json to_json(double time_offset) const;
+};
+
+/*!
+ * \brief Drains a tx_streamer's asynchronous messages on a background thread
+ *
+ * Underflows, sequence errors, late packets and burst ACKs are counted per channel.
+ */
+class tx_event_monitor
+{
+public:
+    /*!
+     * \param streamer the streamer to monitor
+     * \param channels AWG channel for each of the streamer's channels
+     * \param counters per-AWG-channel counters, with an entry for every channel; must
+     * outlive the monitor
+     */
+    tx_event_monitor(std::shared_ptr<uhd::tx_streamer> streamer,
+        const std::vector<size_t>& channels,
+        std::map<size_t, tx_event_counters>& counters);
+    //! drains outstanding messages, then stops the thread
+    ~tx_event_monitor();
+    tx_event_monitor(const tx_event_monitor&) = delete;
+    tx_event_monitor& operator=(const tx_event_monitor&) = delete;
+
+private:
+    void run();
+    bool poll(double timeout);
+
+    std::shared_ptr<uhd::tx_streamer> streamer;
+    std::vector<tx_event_counters*> counters;
+    std::atomic<bool> running{true};
+    std::thread thread;
+};
+
+/*!
+ * \brief Print the counters of every channel
+ *
+ * \param time_offset subtracted from device times, to report times in program time
+ */
+void print_tx_events(const std::map<size_t, tx_event_counters>& counters, double time_offset);
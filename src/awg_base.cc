@@ -5,10 +5,24 @@
  *
  */
 #include "multichannel_awg/multichannel_awg.hpp"
+#include <fmt/format.h>
+#include <nlohmann/json.hpp>
+#include <memory>
 #include <string>
 #include <atomic>
 
 awg_base::awg_base(const std::string& addr, const std::atomic<bool>& stop) : address(addr), stop(stop) {};
+bool awg_base::swap_program(std::unique_ptr<sequencer_data>)
+{
+    fmt::print(stderr, "Swapping programs while running isn't supported in this mode\n");
+    return false;
+}
+
+nlohmann::json awg_base::statistics() const
+{
+    return nlohmann::json::object();
+}
+
 awg_base::~awg_base()
 {
     ;
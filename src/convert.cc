@@ -0,0 +1,151 @@
+/*
+ * Copyright 2023 Ettus Research, A National Instruments Brand
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+#include "multichannel_awg/convert.hpp"
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <numbers>
+
+#if defined(__AVX2__)
+#    include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#    include <emmintrin.h>
+#endif
+
+namespace {
+constexpr float sc16_max = 32767.0f;
+constexpr float sc16_min = -32768.0f;
+//! samples per oscillator block; a fixed trip count lets the compiler vectorize
+constexpr size_t mix_block = 256;
+
+size_t convert_scalar(const float* in, int16_t* out, size_t ncomponents, float scale)
+{
+    size_t clipped = 0;
+    for (size_t idx = 0; idx < ncomponents; ++idx) {
+        const float value = in[idx] * scale;
+        if (value > sc16_max || value < sc16_min) {
+            ++clipped;
+        }
+        out[idx] = static_cast<int16_t>(std::lrint(std::clamp(value, sc16_min, sc16_max)));
+    }
+    return clipped;
+}
+} // namespace
+
+void mix_fc32(const float* in,
+    float* out,
+    size_t nitems,
+    float gain,
+    double frequency,
+    double phase)
+{
+    // Oscillator table per block: its first value from the exact phase (in double), the
+    // rest by a short recurrence; then one branch-free complex multiply over the block
+    const double step = 2.0 * std::numbers::pi * frequency;
+    float osc_re[mix_block];
+    float osc_im[mix_block];
+    float block_in[2 * mix_block];
+    for (size_t first = 0; first < nitems; first += mix_block) {
+        const size_t count = std::min(mix_block, nitems - first);
+        const double start = phase + step * static_cast<double>(first);
+        const float rot_re = static_cast<float>(std::cos(step));
+        const float rot_im = static_cast<float>(std::sin(step));
+        osc_re[0]          = gain * static_cast<float>(std::cos(start));
+        osc_im[0]          = gain * static_cast<float>(std::sin(start));
+        for (size_t idx = 1; idx < mix_block; ++idx) {
+            osc_re[idx] = osc_re[idx - 1] * rot_re - osc_im[idx - 1] * rot_im;
+            osc_im[idx] = osc_re[idx - 1] * rot_im + osc_im[idx - 1] * rot_re;
+        }
+        // copy first, so that in and out may alias; the tail of a block is zero-padded
+        std::fill(std::copy(in + 2 * first, in + 2 * (first + count), block_in),
+            block_in + 2 * mix_block,
+            0.0f);
+        float block_out[2 * mix_block];
+        for (size_t idx = 0; idx < mix_block; ++idx) {
+            const float re         = block_in[2 * idx];
+            const float im         = block_in[2 * idx + 1];
+            block_out[2 * idx]     = re * osc_re[idx] - im * osc_im[idx];
+            block_out[2 * idx + 1] = re * osc_im[idx] + im * osc_re[idx];
+        }
+        std::copy(block_out, block_out + 2 * count, out + 2 * first);
+    }
+}
+
+size_t mix_sc16(const int16_t* in,
+    int16_t* out,
+    size_t nitems,
+    float gain,
+    double frequency,
+    double phase)
+{
+    size_t clipped = 0;
+    float block[2 * mix_block];
+    for (size_t first = 0; first < nitems; first += mix_block) {
+        const size_t count = std::min(mix_block, nitems - first);
+        std::copy(in + 2 * first, in + 2 * (first + count), block);
+        mix_fc32(block,
+            block,
+            count,
+            gain,
+            frequency,
+            phase + 2.0 * std::numbers::pi * frequency * static_cast<double>(first));
+        clipped += convert_fc32_to_sc16(block, out + 2 * first, count, 1.0f);
+    }
+    return clipped;
+}
+
+size_t convert_fc32_to_sc16(const float* in, int16_t* out, size_t nitems, float scale)
+{
+    const size_t ncomponents = 2 * nitems;
+    size_t clipped           = 0;
+    size_t idx               = 0;
+
+#if defined(__AVX2__)
+    const __m256 vscale = _mm256_set1_ps(scale);
+    const __m256 vmax   = _mm256_set1_ps(sc16_max);
+    const __m256 vmin   = _mm256_set1_ps(sc16_min);
+    for (; idx + 16 <= ncomponents; idx += 16) {
+        __m256 lo = _mm256_mul_ps(_mm256_loadu_ps(in + idx), vscale);
+        __m256 hi = _mm256_mul_ps(_mm256_loadu_ps(in + idx + 8), vscale);
+        const int over =
+            _mm256_movemask_ps(_mm256_or_ps(_mm256_cmp_ps(lo, vmax, _CMP_GT_OQ),
+                _mm256_cmp_ps(lo, vmin, _CMP_LT_OQ)))
+            | (_mm256_movemask_ps(_mm256_or_ps(_mm256_cmp_ps(hi, vmax, _CMP_GT_OQ),
+                   _mm256_cmp_ps(hi, vmin, _CMP_LT_OQ)))
+                << 8);
+        clipped += std::popcount(static_cast<unsigned>(over));
+        lo = _mm256_max_ps(_mm256_min_ps(lo, vmax), vmin);
+        hi = _mm256_max_ps(_mm256_min_ps(hi, vmax), vmin);
+        // packs works per 128 bit lane; permute restores sample order
+        const __m256i packed = _mm256_packs_epi32(
+            _mm256_cvtps_epi32(lo), _mm256_cvtps_epi32(hi));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + idx),
+            _mm256_permute4x64_epi64(packed, 0xd8));
+    }
+#elif defined(__SSE2__) || defined(_M_X64)
+    const __m128 vscale = _mm_set1_ps(scale);
+    const __m128 vmax   = _mm_set1_ps(sc16_max);
+    const __m128 vmin   = _mm_set1_ps(sc16_min);
+    for (; idx + 8 <= ncomponents; idx += 8) {
+        __m128 lo = _mm_mul_ps(_mm_loadu_ps(in + idx), vscale);
+        __m128 hi = _mm_mul_ps(_mm_loadu_ps(in + idx + 4), vscale);
+        const int over =
+            _mm_movemask_ps(_mm_or_ps(_mm_cmpgt_ps(lo, vmax), _mm_cmplt_ps(lo, vmin)))
+            | (_mm_movemask_ps(_mm_or_ps(_mm_cmpgt_ps(hi, vmax), _mm_cmplt_ps(hi, vmin)))
+                << 4);
+        clipped += std::popcount(static_cast<unsigned>(over));
+        lo = _mm_max_ps(_mm_min_ps(lo, vmax), vmin);
+        hi = _mm_max_ps(_mm_min_ps(hi, vmax), vmin);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + idx),
+            _mm_packs_epi32(_mm_cvtps_epi32(lo), _mm_cvtps_epi32(hi)));
+    }
+#endif
+
+    return clipped + convert_scalar(in + idx, out + idx, ncomponents - idx, scale);
+}
@@ -0,0 +1,66 @@
+/*
+ * Copyright 2023 Ettus Research, A National Instruments Brand
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+#include "multichannel_awg/histogram.hpp"
+#include <nlohmann/json.hpp>
+#include <algorithm>
+#include <bit>
+#include <string>
+
+void log_histogram::record(uint64_t value)
+{
+    const size_t bucket = std::min<size_t>(std::bit_width(value), NUM_BUCKETS - 1);
+    // single writer: load/store instead of read-modify-write
+    buckets[bucket].store(
+        buckets[bucket].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    sum.store(sum.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    if (value < min.load(std::memory_order_relaxed)) {
+        min.store(value, std::memory_order_relaxed);
+    }
+    if (value > max.load(std::memory_order_relaxed)) {
+        max.store(value, std::memory_order_relaxed);
+    }
+    count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+nlohmann::json log_histogram::to_json() const
+{
+    const uint64_t n = count.load(std::memory_order_acquire);
+    nlohmann::json result = {{"count", n}};
+    if (n == 0) {
+        return result;
+    }
+    result["min"]  = min.load(std::memory_order_relaxed);
+    result["max"]  = max.load(std::memory_order_relaxed);
+    result["mean"] = static_cast<double>(sum.load(std::memory_order_relaxed)) / n;
+    nlohmann::json hist = nlohmann::json::object();
+    for (size_t bucket = 0; bucket < NUM_BUCKETS; ++bucket) {
+        const uint64_t bucket_count = buckets[bucket].load(std::memory_order_relaxed);
+        if (bucket_count) {
+            // keyed by the (exclusive) upper bound of the bucket
+            hist[std::to_string(bucket ? uint64_t(1) << bucket : 1)] = bucket_count;
+        }
+    }
+    result["buckets"] = std::move(hist);
+    return result;
+}
+
+void stream_timing::record(uint64_t send_ns, int64_t slack_ns)
+{
+    send_latency.record(send_ns);
+    if (slack_ns >= 0) {
+        slack.record(static_cast<uint64_t>(slack_ns));
+    } else {
+        late.record(static_cast<uint64_t>(-slack_ns));
+    }
+}
+
+nlohmann::json stream_timing::to_json() const
+{
+    return {{"send_latency_ns", send_latency.to_json()},
+        {"slack_ns", slack.to_json()},
+        {"late_ns", late.to_json()}};
+}
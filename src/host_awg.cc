@@ -7,19 +7,26 @@
 #include "multichannel_awg/host_awg.hpp"
 #include "fmt/core.h"
 #include "multichannel_awg/multichannel_awg.hpp"
+#include "multichannel_awg/segment_store.hpp"
 #include "multichannel_awg/sequence.hpp"
 #include <uhd/exception.hpp>
 #include <uhd/stream.hpp>
 #include <uhd/types/metadata.hpp>
 #include <uhd/types/time_spec.hpp>
 #include <uhd/usrp/multi_usrp.hpp>
+#include <uhd/utils/thread.hpp>
 #include <fmt/format.h>
 #include <algorithm>
+#include <barrier>
+#include <chrono>
 #include <cmath>
+#include <cstdint>
+#include <cstring>
 #include <cstddef>
 #include <cstdio>
 #include <filesystem>
 #include <fstream>
+#include <functional>
 #include <future>
 #include <memory>
 #include <string>
@@ -28,47 +35,62 @@
 #include <atomic>
 
 
-constexpr unsigned int time_offset = (1ULL << 20);
+constexpr unsigned int time_offset = host_awg::TIME_OFFSET;
+// Short send timeout, so that workers notice a stop request even while blocked on flow
+// control; a timed-out send is simply retried.
+constexpr double send_timeout = 0.1; // seconds
 
 host_awg::host_awg(const std::string& address, const std::atomic<bool>& stop) : awg_base(address, stop) {}
 
 bool host_awg::load_program(std::unique_ptr<sequencer_data> dat)
 {
-    seq_data      = std::move(dat);
+    auto loaded   = std::make_shared<loaded_program>();
+    loaded->data  = std::move(dat);
+    seq_data      = loaded->data.get();
     sampling_rate = seq_data->settings.sampling_rate;
-    auto itemsize = static_cast<size_t>(seq_data->settings.cpu_format);
-
-    size_t total_size = 0;
-    for (auto& [id, seg] : seq_data->filemap) {
-        auto length_bytes = std::filesystem::file_size(seg.filename.data());
-        seg.length        = length_bytes / itemsize;
-        total_size += length_bytes;
-    }
-    buffer.resize(total_size);
-
-    size_t currsize = 0;
-    for (auto& [id, seg] : seq_data->filemap) {
-        seg.start_idx       = currsize;
-        seg.data            = buffer.data() + currsize;
-        size_t length_bytes = seg.length * 8;
-        std::ifstream input_file(seg.filename.data(), std::ios::binary);
-        input_file.read(buffer.data() + currsize, length_bytes);
-        currsize += length_bytes;
-        fmt::print(
-            FMT_STRING(
-                "Appended {:L} B of data from file '{}' for segment '{}' to buffer\n"),
-            length_bytes,
-            seg.filename,
-            seg.name);
+
+    try {
+        loaded->store.load(seq_data->filemap, seq_data->settings.loading);
+        if (seq_data->settings.preconvert.enabled) {
+            preconvert_segments(*seq_data, loaded->store);
+        }
+    } catch (const std::exception& err) {
+        fmt::print(stderr, FMT_STRING("{}\n"), err.what());
+        seq_data = nullptr;
+        return false;
     }
-    for (auto& [channel, sp_container] : seq_data->used_channels) {
-        sequence_workers.emplace(std::make_pair(channel,
-            sequencer_state{
-                sp_container.begin(), sp_container.cend(), seq_data.get(), nullptr}));
+    settings      = seq_data->settings;
+    first_program = std::move(loaded);
+    for (const auto& [channel, timeline] : seq_data->program.channels) {
+        // statistics() may read these from another thread at any time, so they're
+        // created up front, never while running
+        event_counters.try_emplace(channel);
+        stream_timings.try_emplace(channel);
+        swap_slots.try_emplace(channel);
+        auto& worker = sequence_workers.emplace(std::make_pair(channel,
+            sequencer_state{channel,
+                timeline,
+                seq_data,
+                nullptr,
+                stop})).first->second;
+        worker.loaded = first_program;
     }
     return true;
 }
 
+void host_awg::preconvert_segments(sequencer_data& data, segment_store& segments)
+{
+    auto& settings = data.settings;
+    if (settings.cpu_format != dataformat_e::FC_32) {
+        fmt::print(FMT_STRING("Segments already in {} format, not converting\n"),
+            format_name(settings.cpu_format));
+        settings.preconvert.enabled = false;
+        return;
+    }
+    segments.convert_to_sc16(data.filemap, settings.preconvert);
+    settings.cpu_format = dataformat_e::SC_16;
+}
+
 bool host_awg::initialize()
 {
     fmt::print("Initializing host with address '{}'\n", address);
@@ -89,13 +111,231 @@ bool host_awg::initialize()
 
 bool host_awg::start()
 {
-    for (auto& [channel, s_state] : sequence_workers) {
-        (void)channel;
-        s_state();
+    std::vector<std::tuple<std::string, std::function<void()>>> jobs;
+
+    clock.host_ref   = std::chrono::steady_clock::now();
+    clock.device_ref = device_time();
+
+    // Streamers are created here rather than in the worker threads: streamer creation
+    // isn't something we want to do concurrently.
+    if (settings.streaming.aligned) {
+        if (!seq_data->program.live.empty()) {
+            fmt::print(stderr,
+                FMT_STRING("Streaming sequence input is not supported in aligned mode\n"));
+            return false;
+        }
+        for (const auto& [id, seg] : seq_data->filemap) {
+            if (seg.streamed && seg.referenced) {
+                fmt::print(stderr,
+                    FMT_STRING("Segment '{}': streamed segments are not supported in "
+                               "aligned mode\n"),
+                    id);
+                return false;
+            }
+        }
+        build_aligned_state();
+        aligned_worker.clock = &clock;
+        for (auto channel : aligned_worker.channels) {
+            aligned_worker.timings.push_back(&stream_timings.at(channel));
+        }
+        uhd::stream_args_t stream_args(format_name(settings.cpu_format),
+            format_name(settings.wire_format));
+        stream_args.channels       = aligned_worker.channels;
+        aligned_worker.tx_streamer = make_tx_stream(stream_args);
+        monitors.push_back(std::make_unique<tx_event_monitor>(
+            aligned_worker.tx_streamer, aligned_worker.channels, event_counters));
+        jobs.emplace_back("awg_tx", [this]() { aligned_worker(stop); });
+    } else {
+        std::vector<size_t> channels;
+        for (const auto& [channel, s_state] : sequence_workers) {
+            channels.push_back(channel);
+        }
+        std::sort(channels.begin(), channels.end());
+        if (settings.swap.enabled) {
+            reaper = std::make_unique<program_reaper>();
+        }
+        for (auto channel : channels) {
+            auto& s_state   = sequence_workers.at(channel);
+            s_state.timing = &stream_timings.at(channel);
+            s_state.clock  = &clock;
+            s_state.swaps  = &swap_slots.at(channel);
+            s_state.reaper = reaper.get();
+            s_state.hold   = settings.swap.enabled;
+            uhd::stream_args_t stream_args(format_name(settings.cpu_format),
+                format_name(settings.wire_format));
+            stream_args.channels = {channel};
+            s_state.tx_streamer  = make_tx_stream(stream_args);
+            monitors.push_back(std::make_unique<tx_event_monitor>(
+                s_state.tx_streamer, std::vector<size_t>{channel}, event_counters));
+            jobs.emplace_back(
+                fmt::format(FMT_STRING("awg_tx{}"), channel), [&s_state]() { s_state(); });
+        }
+        swappable.store(seq_data->program.live.empty());
+    }
+    run_workers(std::move(jobs));
+    swappable.store(false);
+
+    // Let the monitors pick up the last bursts' events before reporting
+    monitors.clear();
+    print_tx_events(event_counters, static_cast<double>(time_offset));
+    return true;
+}
+
+bool host_awg::swap_program(std::unique_ptr<sequencer_data> seq)
+{
+    if (!swappable.load()) {
+        fmt::print(stderr,
+            FMT_STRING("Programs can only be swapped while streaming with one thread per "
+                       "channel, without sequence input\n"));
+        return false;
+    }
+    const auto& running  = settings;
+    auto& new_settings   = seq->settings;
+    if (new_settings.sampling_rate != running.sampling_rate
+        || new_settings.wire_format != running.wire_format) {
+        fmt::print(stderr,
+            FMT_STRING("New program must have the same sampling rate and wire format\n"));
+        return false;
     }
+    for (const auto& [channel, timeline] : seq->program.channels) {
+        if (!swap_slots.contains(channel)) {
+            fmt::print(stderr,
+                FMT_STRING("New program uses channel {}, which isn't streaming\n"),
+                channel);
+            return false;
+        }
+    }
+
+    // Load while the current program plays on
+    auto next  = std::make_shared<loaded_program>();
+    next->data = std::move(seq);
+    try {
+        next->store.load(next->data->filemap, new_settings.loading);
+        if (new_settings.preconvert.enabled) {
+            preconvert_segments(*next->data, next->store);
+        }
+    } catch (const std::exception& err) {
+        fmt::print(stderr, FMT_STRING("{}\n"), err.what());
+        return false;
+    }
+    if (new_settings.cpu_format != running.cpu_format) {
+        fmt::print(stderr,
+            FMT_STRING("New program has {} samples, the running one {}\n"),
+            format_name(new_settings.cpu_format),
+            format_name(running.cpu_format));
+        return false;
+    }
+
+    const double swap_time = device_time() - time_offset + running.swap.lead_time;
+    const auto swap        = std::make_shared<const program_swap>(program_swap{next,
+        static_cast<uint64_t>(std::ceil(std::max(swap_time, 0.0) * sampling_rate))});
+    fmt::print(FMT_STRING("Swapping in new program at {} s\n"),
+        static_cast<double>(swap->tick) / sampling_rate);
+    for (auto& [channel, slot] : swap_slots) {
+        slot.post(swap);
+    }
+    // Each worker retires the first program when it takes the swap; then it's freed
+    first_program.reset();
+    seq_data = nullptr;
     return true;
 }
 
+nlohmann::json host_awg::statistics() const
+{
+    nlohmann::json channels = nlohmann::json::object();
+    for (const auto& [channel, counters] : event_counters) {
+        channels[std::to_string(channel)] = {
+            {"events", counters.to_json(static_cast<double>(time_offset))},
+            {"timing", stream_timings.at(channel).to_json()}};
+    }
+    return {{"mode", "host"}, {"channels", std::move(channels)}};
+}
+
+void host_awg::build_aligned_state()
+{
+    aligned_worker.itemsize      = static_cast<size_t>(settings.cpu_format);
+    aligned_worker.sampling_rate = sampling_rate;
+    for (const auto& [channel, timeline] : seq_data->program.channels) {
+        aligned_worker.channels.push_back(channel);
+    }
+
+    for (auto channel : aligned_worker.channels) {
+        channel_cursor cursor;
+        cursor.program  = &seq_data->program;
+        cursor.timeline = timeline_cursor(
+            seq_data->program, seq_data->program.channels.at(channel));
+        cursor.has_current = cursor.timeline.next(cursor.current);
+        if (!cursor.finished()) {
+            cursor.next_tick = cursor.current.start_tick;
+        }
+        aligned_worker.cursors.push_back(std::move(cursor));
+    }
+}
+
+void host_awg::run_workers(
+    std::vector<std::tuple<std::string, std::function<void()>>>&& jobs)
+{
+    const auto& streaming = settings.streaming;
+
+    // All workers wait here until every one of them is set up, so that no channel gets
+    // a head start on the others
+    std::barrier start_barrier(static_cast<std::ptrdiff_t>(jobs.size()));
+    for (size_t idx = 0; idx < jobs.size(); ++idx) {
+        std::vector<size_t> cpus;
+        if (idx < streaming.cpu_affinity.size()) {
+            cpus.push_back(streaming.cpu_affinity[idx]);
+        }
+        auto& [name, job] = jobs[idx];
+        worker_threads.emplace_back(
+            [&name = name, &job = job, &start_barrier, &streaming, cpus]() {
+                if (!cpus.empty()) {
+                    uhd::set_thread_affinity(cpus);
+                }
+                if (streaming.thread_priority > 0.0f || streaming.realtime) {
+                    if (!uhd::set_thread_priority_safe(
+                            streaming.thread_priority, streaming.realtime)) {
+                        fmt::print(stderr,
+                            FMT_STRING("{}: could not set thread priority {} "
+                                       "(realtime: {})\n"),
+                            name,
+                            streaming.thread_priority,
+                            streaming.realtime);
+                    }
+                }
+                start_barrier.arrive_and_wait();
+                try {
+                    job();
+                } catch (const std::exception& err) {
+                    fmt::print(
+                        stderr, FMT_STRING("{}: streaming failed: {}\n"), name, err.what());
+                }
+            });
+        uhd::set_thread_name(&worker_threads.back(), name);
+    }
+    join_workers();
+}
+
+void host_awg::join_workers()
+{
+    for (auto& thread : worker_threads) {
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+    worker_threads.clear();
+}
+
+std::shared_ptr<uhd::tx_streamer> host_awg::make_tx_stream(
+    const uhd::stream_args_t& stream_args)
+{
+    return usrp->get_tx_stream(stream_args);
+}
+
+double host_awg::device_time()
+{
+    return usrp->get_time_now().get_real_secs();
+}
+
 void host_awg::setup_clocking()
 {
     // We set the master clock source
@@ -105,7 +345,7 @@ void host_awg::setup_clocking()
 
     // We set the clock source of the 0. USRP to internal, all others
     // get the clock via clock distribution from that. Same for PPS.
-    std::string clk_source(seq_data->settings.clock_source == clock_source_e::EXTERNAL
+    std::string clk_source(settings.clock_source == clock_source_e::EXTERNAL
                                ? "external"
                                : "internal");
     usrp->set_clock_source(clk_source, 0);
@@ -156,65 +396,444 @@ void host_awg::sync_dance()
 
 host_awg::~host_awg()
 {
-    ;
+    join_workers();
 }
 
 void sequencer_state::operator()()
 {
-    // TODO make types flexible
-    tx_streamer = usrp->get_tx_stream({"fc32", "sc16"});
+    uhd::tx_metadata_t metadata;
+    metadata.start_of_burst = false;
+    metadata.end_of_burst   = false;
+    // tick right after the data sent so far, i.e. where the running burst continues
+    uint64_t burst_end = UINT64_MAX;
+
+    // A swapped-in program's ticks count from the swap tick
+    uint64_t offset = 0;
+    timeline_cursor cursor(data->program, timeline);
+    // one entry of lookahead, so that a streamed segment's reader can be opened early
+    timeline_entry entry;
+    timeline_entry upcoming;
+    bool has_upcoming = false;
+    auto pull         = [&](timeline_entry& into) {
+        if (!cursor.next(into)) {
+            return false;
+        }
+        into.start_tick += offset;
+        return true;
+    };
+    auto next_entry = [&]() {
+        const bool has_next = has_upcoming;
+        if (has_next) {
+            entry        = upcoming;
+            has_upcoming = pull(upcoming);
+        }
+        return has_next;
+    };
+    has_upcoming   = pull(upcoming);
+    bool has_entry = next_entry();
+    // the last entry was cut short by a due swap, at burst_end
+    bool cut = false;
+    // tick after the last sample sent; a new program's entries can't start before it
+    uint64_t sent_until = 0;
+    while (!stop.load()) {
+        const uint64_t boundary = cut ? burst_end : has_entry ? entry.start_tick : UINT64_MAX;
+        if (const auto swap = swaps ? swaps->take(boundary) : nullptr) {
+            fmt::print(FMT_STRING("Channel {}: new program from {} s\n"),
+                channel,
+                static_cast<double>(boundary == UINT64_MAX ? swap->tick : boundary)
+                    / data->program.sampling_rate);
+            // it may be for a segment of the old program
+            prefetched.reset();
+            if (reaper) {
+                reaper->retire(std::move(loaded));
+            }
+            loaded         = swap->program;
+            data           = loaded->data.get();
+            offset         = swap->tick;
+            const auto own = data->program.channels.find(channel);
+            cursor         = own == data->program.channels.end()
+                                 ? timeline_cursor()
+                                 : timeline_cursor(data->program, own->second);
+            has_upcoming   = pull(upcoming);
+            has_entry      = next_entry();
+            cut            = false;
+            continue;
+        }
+        if (!has_entry) {
+            if (!hold) {
+                break;
+            }
+            // Idle until the next program arrives; close the burst meanwhile
+            if (burst_end != UINT64_MAX) {
+                uhd::tx_metadata_t eob;
+                eob.has_time_spec = false;
+                eob.end_of_burst  = true;
+                tx_streamer->send("", 0, eob, send_timeout);
+                burst_end = UINT64_MAX;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            continue;
+        }
+        entry.start_tick = std::max(entry.start_tick, sent_until);
+        if (play(entry, metadata, burst_end, has_upcoming ? &upcoming : nullptr)) {
+            has_entry = next_entry();
+        } else {
+            cut = true;
+        }
+        sent_until = burst_end;
+    }
+
+    // Then whatever arrives through the sequence input, until it ends
+    const auto live = data->program.live.find(channel);
+    if (live != data->program.live.end()) {
+        while (!stop.load()) {
+            const auto result = live->second->pop(entry, std::chrono::milliseconds(100));
+            if (result == timeline_queue::status::CLOSED) {
+                break;
+            }
+            if (result == timeline_queue::status::ENTRY) {
+                play(entry, metadata, burst_end);
+            }
+        }
+    }
+
+    // Close the burst, so the device doesn't report the end of our data as underflow
+    uhd::tx_metadata_t eob;
+    eob.has_time_spec = false;
+    eob.end_of_burst  = true;
+    tx_streamer->send("", 0, eob, send_timeout);
+}
+
+bool sequencer_state::play(const timeline_entry& entry,
+    uhd::tx_metadata_t& metadata,
+    uint64_t& burst_end,
+    const timeline_entry* upcoming)
+{
+    const size_t itemsize = static_cast<size_t>(data->settings.cpu_format);
+    const auto& program   = data->program;
+
+    const segment_spec& sspec = *program.segments[entry.segment];
+    fmt::print(FMT_STRING("Channel {} Start Time {} segment name \"{}\"\n"),
+        channel,
+        static_cast<double>(entry.start_tick) / program.sampling_rate,
+        sspec.name);
 
+    // Only a gap needs a new timestamp; back-to-back entries continue the burst
+    if (entry.start_tick != burst_end) {
+        if (burst_end != UINT64_MAX) {
+            uhd::tx_metadata_t eob;
+            eob.has_time_spec = false;
+            eob.end_of_burst  = true;
+            tx_streamer->send("", 0, eob, send_timeout);
+        }
+        metadata.has_time_spec = true;
+        metadata.time_spec =
+            uhd::time_spec_t::from_ticks(
+                static_cast<long long>(entry.start_tick), program.sampling_rate)
+            + uhd::time_spec_t{static_cast<double>(time_offset)};
+    }
+    burst_end = entry.end_tick();
+
+    if (sspec.streamed) {
+        // all repetitions in one go, read from disk as one continuous stream
+        stream_from_disk(sspec, entry, metadata, upcoming);
+        return true;
+    }
+
+    const char* first = sspec.data + entry.sample_offset * itemsize;
+    uint64_t tick     = entry.start_tick;
+    for (uint64_t played = 0;
+         (entry.repeat_count == timeline_entry::FOREVER || played < entry.repeat_count)
+         && !stop.load();
+         ++played) {
+        if (played > 0 && swaps && swaps->due(tick)) {
+            burst_end = tick;
+            return false;
+        }
+        tick += send_span(first, entry.length, tick, metadata);
+        if (played == 0) {
+            prefetch(upcoming);
+        }
+    }
+    return true;
+}
+
+uint64_t sequencer_state::send_span(
+    const char* buff, uint64_t nsamps, uint64_t tick, uhd::tx_metadata_t& metadata)
+{
     const size_t buffersize = tx_streamer->get_max_num_samps();
     const size_t itemsize   = static_cast<size_t>(data->settings.cpu_format);
+    const double rate       = data->program.sampling_rate;
 
-    while (begin != end) {
-        sequence_point& current_sp = *begin;
-        auto segment_name          = current_sp.segment;
-        fmt::print(
-            FMT_STRING("Channel {} Segment {} Start Time {} segment name \"{}\"\n"),
-            current_sp.channel,
-            current_sp.segment,
-            current_sp.start_time,
-            segment_name);
-
-        const segment_spec& sspec = data->filemap.at(segment_name);
-        // using namespace std::chrono_literals;
-        // std::this_thread::sleep_for(1000ms);
+    uint64_t transmitted_yet = 0;
+    while (transmitted_yet < nsamps && !stop.load()) {
+        const size_t samples_to_send =
+            std::min<uint64_t>(nsamps - transmitted_yet, buffersize);
+        const size_t sent_this_iteration = timed_send(buff + transmitted_yet * itemsize,
+            samples_to_send,
+            metadata,
+            static_cast<double>(time_offset)
+                + static_cast<double>(tick + transmitted_yet) / rate);
+        transmitted_yet += sent_this_iteration;
+        if (sent_this_iteration > 0) {
+            metadata.has_time_spec = false;
+        }
+    }
+    return transmitted_yet;
+}
+
+size_t sequencer_state::timed_send(const char* buff,
+    size_t nsamps,
+    const uhd::tx_metadata_t& metadata,
+    double packet_time)
+{
+    const auto before = std::chrono::steady_clock::now();
+    const size_t sent = tx_streamer->send(buff, nsamps, metadata, send_timeout);
+    const auto after  = std::chrono::steady_clock::now();
+    if (timing) {
+        timing->record(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(after - before).count(),
+            std::llround((packet_time - clock->at(before)) * 1e9));
+    }
+    return sent;
+}
+
+void swap_slot::post(std::shared_ptr<const program_swap> swap)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    due_tick.store(swap->tick);
+    posted = std::move(swap);
+}
+
+std::shared_ptr<const program_swap> swap_slot::take(uint64_t tick)
+{
+    if (!due(tick)) {
+        return nullptr;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    // may have been replaced by a later swap meanwhile
+    if (!posted || tick < posted->tick) {
+        return nullptr;
+    }
+    due_tick.store(UINT64_MAX);
+    return std::move(posted);
+}
+
+program_reaper::program_reaper() : thread(&program_reaper::run, this)
+{
+    uhd::set_thread_name(&thread, "awg_reaper");
+}
+
+program_reaper::~program_reaper()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        done = true;
+    }
+    retired_cv.notify_one();
+    thread.join();
+}
+
+void program_reaper::retire(std::shared_ptr<const loaded_program> program)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        retired.push_back(std::move(program));
+    }
+    retired_cv.notify_one();
+}
+
+void program_reaper::run()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        retired_cv.wait(lock, [this]() { return done || !retired.empty(); });
+        std::vector<std::shared_ptr<const loaded_program>> dropped;
+        dropped.swap(retired);
+        if (dropped.empty() && done) {
+            return;
+        }
+        // free them without blocking retire()
+        lock.unlock();
+        dropped.clear();
+        lock.lock();
+    }
+}
+
+namespace {
+uint64_t reader_plays(const timeline_entry& entry)
+{
+    return entry.repeat_count == timeline_entry::FOREVER ? segment_reader::FOREVER
+                                                         : entry.repeat_count;
+}
+} // namespace
+
+void sequencer_state::prefetch(const timeline_entry* upcoming)
+{
+    if (!upcoming) {
+        return;
+    }
+    const segment_spec& sspec = *data->program.segments[upcoming->segment];
+    const std::pair<const segment_spec*, uint64_t> key{&sspec, reader_plays(*upcoming)};
+    if (!sspec.streamed || (prefetched && prefetched_for == key)) {
+        return;
+    }
+    // with preconversion, the file still holds fc32 (sspec.itemsize); the reader converts
+    prefetched = std::make_unique<segment_reader>(sspec,
+        key.second,
+        data->settings.loading,
+        sspec.itemsize,
+        data->settings.preconvert);
+    prefetched_for = key;
+}
+
+void sequencer_state::stream_from_disk(const segment_spec& sspec,
+    const timeline_entry& entry,
+    uhd::tx_metadata_t& metadata,
+    const timeline_entry* upcoming)
+{
+    // Usually opened while the previous entry played
+    if (!prefetched || prefetched_for != std::pair{&sspec, reader_plays(entry)}) {
+        prefetch(&entry);
+    }
+    const auto reader = std::move(prefetched);
+    segment_reader::block blk;
+    uint64_t tick  = entry.start_tick;
+    bool first     = true;
+    while (reader->next(blk, stop)) {
+        tick += send_span(blk.data, blk.length, tick, metadata);
+        reader->release();
+        if (first) {
+            prefetch(upcoming);
+            first = false;
+        }
+    }
+}
+
+void channel_cursor::advance(size_t nsamps)
+{
+    position += nsamps;
+    next_tick += nsamps;
+    if (position < current.length) {
+        return;
+    }
+    position = 0;
+    if (current.repeat_count == timeline_entry::FOREVER
+        || ++played < current.repeat_count) {
+        return;
+    }
+    played      = 0;
+    has_current = timeline.next(current);
+    if (!finished()) {
+        next_tick = std::max(next_tick, current.start_tick);
+    }
+}
+
+const char* channel_cursor::fill(
+    uint64_t tick, size_t nsamps, size_t itemsize, char* scratch)
+{
+    size_t done = 0;
+    while (done < nsamps) {
+        const uint64_t now = tick + done;
+        if (finished()) {
+            std::memset(scratch + done * itemsize, 0, (nsamps - done) * itemsize);
+            break;
+        }
+        if (now < next_tick) {
+            const size_t idle = std::min<uint64_t>(nsamps - done, next_tick - now);
+            std::memset(scratch + done * itemsize, 0, idle * itemsize);
+            done += idle;
+            continue;
+        }
+        const size_t take = std::min<uint64_t>(nsamps - done, current.length - position);
+        const char* source = program->segments[current.segment]->data
+                             + (current.sample_offset + position) * itemsize;
+        advance(take);
+        // Whole packet from one contiguous piece of segment: no need to copy
+        if (take == nsamps) {
+            return source;
+        }
+        std::memcpy(scratch + done * itemsize, source, take * itemsize);
+        done += take;
+    }
+    return scratch;
+}
+
+void aligned_sequencer_state::operator()(const std::atomic<bool>& stop)
+{
+    const size_t buffersize = tx_streamer->get_max_num_samps();
+    std::vector<std::vector<char>> scratch(
+        cursors.size(), std::vector<char>(buffersize * itemsize));
+    std::vector<const void*> buffs(cursors.size());
+    std::vector<const void*> offset_buffs(cursors.size());
+
+    // earliest tick at which any channel has something to send
+    auto next_activity = [this]() {
+        uint64_t earliest = UINT64_MAX;
+        for (const auto& cursor : cursors) {
+            if (!cursor.finished()) {
+                earliest = std::min(earliest, cursor.next_tick);
+            }
+        }
+        return earliest;
+    };
+
+    uhd::tx_metadata_t eob;
+    eob.has_time_spec = false;
+    eob.end_of_burst  = true;
+
+    uint64_t tick = next_activity();
+    while (tick != UINT64_MAX && !stop.load()) {
+        // Start a timed burst at the first tick any channel is active; it runs until all
+        // channels are idle for longer than a packet
         uhd::tx_metadata_t metadata;
-        metadata.has_time_spec = true;
-        metadata.time_spec     = uhd::time_spec_t{current_sp.start_time}
+        metadata.has_time_spec  = true;
+        metadata.time_spec      = uhd::time_spec_t::from_ticks(tick, sampling_rate)
                              + uhd::time_spec_t{static_cast<double>(time_offset)};
-        metadata.start_of_burst = false;
+        metadata.start_of_burst = true;
         metadata.end_of_burst   = false;
+        fmt::print(FMT_STRING("Aligned burst on {} channels at {} s\n"),
+            channels.size(),
+            static_cast<double>(tick) / sampling_rate);
 
-        const double timeout   = 3600; // seconds
-        size_t transmitted_yet = 0;
-        while (transmitted_yet < sspec.length) {
-            size_t samples_to_send = std::min(sspec.length - transmitted_yet, buffersize);
-            size_t sent_this_iteration =
-                tx_streamer->send(sspec.data + transmitted_yet * itemsize,
-                    samples_to_send,
-                    metadata,
-                    timeout);
-            if (sent_this_iteration < samples_to_send) {
-                fmt::print(stderr,
-                    FMT_STRING(
-                        "Transmitted less samples than expected ({}  <  {}). Timeout?\n"),
-                    sent_this_iteration,
-                    samples_to_send);
+        while (!stop.load()) {
+            const uint64_t next = next_activity();
+            if (next == UINT64_MAX || next >= tick + buffersize) {
+                tick = next;
+                break;
             }
-            transmitted_yet += sent_this_iteration;
-            metadata.has_time_spec = false;
-        }
-
-        if (current_sp.repetitions > 1) /* more than one repitition left*/
-        {
-            --current_sp.repetitions;
-        } else if (current_sp.repetitions < 1) /*loop endlessly*/
-        {
-            continue;
-        } else {
-            ++begin;
+            for (size_t idx = 0; idx < cursors.size(); ++idx) {
+                buffs[idx] =
+                    cursors[idx].fill(tick, buffersize, itemsize, scratch[idx].data());
+            }
+            size_t sent = 0;
+            while (sent < buffersize && !stop.load()) {
+                for (size_t idx = 0; idx < buffs.size(); ++idx) {
+                    offset_buffs[idx] = static_cast<const char*>(buffs[idx]) + sent * itemsize;
+                }
+                const auto before                = std::chrono::steady_clock::now();
+                const size_t sent_this_iteration = tx_streamer->send(
+                    offset_buffs, buffersize - sent, metadata, send_timeout);
+                const auto after = std::chrono::steady_clock::now();
+                const double packet_time =
+                    static_cast<double>(time_offset)
+                    + static_cast<double>(tick + sent) / sampling_rate;
+                const auto send_ns =
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(after - before)
+                        .count();
+                const auto slack_ns =
+                    std::llround((packet_time - clock->at(before)) * 1e9);
+                for (auto* timing : timings) {
+                    timing->record(send_ns, slack_ns);
+                }
+                if (sent_this_iteration > 0) {
+                    metadata.has_time_spec  = false;
+                    metadata.start_of_burst = false;
+                }
+                sent += sent_this_iteration;
+            }
+            tick += buffersize;
         }
+        tx_streamer->send(std::vector<const void*>(cursors.size(), ""), 0, eob, send_timeout);
     }
 }
@@ -8,14 +8,19 @@
 #include "multichannel_awg/sequence.hpp"
 #include <uhd/exception.hpp>
 #include <nlohmann/json.hpp>
+#include <algorithm>
+#include <map>
 #include <stdexcept>
+#include <string>
+#include <vector>
 
 void from_json(const nlohmann::json& j, sequence_point& sp)
 {
     j.at("channel").get_to(sp.channel);
     j.at("start_time").get_to(sp.start_time);
     sp.repetitions = j.value("repetitions", 0);
-    j.at("segment").get_to(sp.segment);
+    // loops ("loop", "pattern") are resolved by sequencer_data, which knows the patterns
+    sp.segment = j.value("segment", std::string{});
 }
 
 NLOHMANN_JSON_SERIALIZE_ENUM(clock_source_e,
@@ -30,6 +35,107 @@ NLOHMANN_JSON_SERIALIZE_ENUM(dataformat_e,
     });
 
 
+void from_json(const nlohmann::json& j, streaming_settings& ss)
+{
+    ss.cpu_affinity    = j.value("cpu_affinity", std::vector<size_t>{});
+    ss.thread_priority = j.value("thread_priority", 0.0f);
+    ss.realtime        = j.value("realtime", false);
+    ss.aligned         = j.value("aligned", false);
+}
+
+void from_json(const nlohmann::json& j, preconvert_settings& ps)
+{
+    // "preconvert": true is shorthand for the defaults
+    if (j.is_boolean()) {
+        ps.enabled = j.get<bool>();
+        return;
+    }
+    ps.enabled  = j.value("enabled", true);
+    ps.scale    = j.value("scale", 32767.0f);
+    ps.saturate = j.value("saturate", true);
+}
+
+NLOHMANN_JSON_SERIALIZE_ENUM(prefault_e,
+    {
+        {prefault_e::NONE, "none"},
+        {prefault_e::WILLNEED, "willneed"},
+        {prefault_e::POPULATE, "populate"},
+    });
+
+void from_json(const nlohmann::json& j, loading_settings& ls)
+{
+    ls.mmap     = j.value("mmap", true);
+    ls.prefault = j.value<prefault_e>("prefault", prefault_e::WILLNEED);
+    ls.mlock    = j.value("mlock", false);
+    ls.load_threads = j.value("load_threads", size_t(0));
+
+    ls.stream_block_size = j.value("stream_block_size", ls.stream_block_size);
+    ls.stream_blocks     = j.value("stream_blocks", ls.stream_blocks);
+    ls.stream_readers    = j.value("stream_readers", ls.stream_readers);
+    ls.direct_io         = j.value("direct_io", false);
+}
+
+void from_json(const nlohmann::json& j, sim_settings& ss)
+{
+    ss.link_rate      = j.value("link_rate", 0.0);
+    ss.buffer_samples = j.value("buffer_samples", ss.buffer_samples);
+    ss.max_samps      = j.value("max_samps", ss.max_samps);
+    // JSON object keys are strings; channels are numbers
+    for (const auto& [channel, filename] :
+        j.value("sinks", std::map<std::string, std::string>{})) {
+        ss.sinks[std::stoul(channel)] = filename;
+    }
+}
+
+void from_json(const nlohmann::json& j, rfnoc_chain& rc)
+{
+    j.at("replay").get_to(rc.replay);
+    j.at("radio").get_to(rc.radio);
+    rc.replay_port = j.value("replay_port", rc.replay_port);
+    rc.radio_port  = j.value("radio_port", rc.radio_port);
+    // "duc": null or no "duc": no DUC in between
+    if (j.contains("duc") && !j.at("duc").is_null()) {
+        j.at("duc").get_to(rc.duc);
+        rc.duc_port = j.value("duc_port", rc.duc_port);
+    }
+}
+
+void from_json(const nlohmann::json& j, rfnoc_settings& rs)
+{
+    for (const auto& [channel, chain] :
+        j.value("channels", std::map<std::string, rfnoc_chain>{})) {
+        rs.channels[std::stoul(channel)] = chain;
+    }
+    rs.verify_schedule = j.value("verify_schedule", false);
+    rs.poll_interval   = std::max(j.value("poll_interval", rs.poll_interval), 1e-4);
+    rs.upload_chunk_size =
+        std::max<size_t>(j.value("upload_chunk_size", rs.upload_chunk_size), 4096);
+    rs.upload_timeout = std::max(j.value("upload_timeout", rs.upload_timeout), 0.0);
+    rs.reuse_memory   = j.value("reuse_memory", rs.reuse_memory);
+    rs.manifest_dir   = j.value("manifest_dir", rs.manifest_dir);
+}
+
+void from_json(const nlohmann::json& j, live_settings& ls)
+{
+    ls.queue_size = std::max<size_t>(j.value("queue_size", ls.queue_size), 1);
+}
+
+void from_json(const nlohmann::json& j, swap_settings& ss)
+{
+    // "swap": true is shorthand for the defaults
+    if (j.is_boolean()) {
+        ss.enabled = j.get<bool>();
+        return;
+    }
+    ss.enabled   = j.value("enabled", true);
+    ss.lead_time = std::max(j.value("lead_time", ss.lead_time), 0.0);
+}
+
+std::string format_name(dataformat_e format)
+{
+    return nlohmann::json(format).get<std::string>();
+}
+
 void from_json(const nlohmann::json& j, device_settings& ds)
 {
     j.at("sampling_rate").get_to(ds.sampling_rate);
@@ -57,4 +163,11 @@ void from_json(const nlohmann::json& j, device_settings& ds)
 
     ds.cpu_format  = j.value<dataformat_e>("data_fmt", dataformat_e::CPU_DEFAULT);
     ds.wire_format = j.value<dataformat_e>("wire_fmt", dataformat_e::WIRE_DEFAULT);
+    ds.streaming   = j.value<streaming_settings>("streaming", streaming_settings{});
+    ds.preconvert  = j.value<preconvert_settings>("preconvert", preconvert_settings{});
+    ds.loading     = j.value<loading_settings>("loading", loading_settings{});
+    ds.sim         = j.value<sim_settings>("sim", sim_settings{});
+    ds.rfnoc       = j.value<rfnoc_settings>("rfnoc", rfnoc_settings{});
+    ds.live        = j.value<live_settings>("live", live_settings{});
+    ds.swap        = j.value<swap_settings>("swap", swap_settings{});
 }
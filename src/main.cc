@@ -5,39 +5,101 @@
  *
  */
 #include "multichannel_awg/multichannel_awg.hpp"
+#include "multichannel_awg/program_file.hpp"
+#include "multichannel_awg/sequence_input.hpp"
 #include "multichannel_awg/sequence.hpp"
 #include "CLI11/CLI11.hpp"
+#include <fmt/format.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <chrono>
+#include <fstream>
 #include <iostream>
 #include <memory>
 #include <set>
+#include <stdexcept>
 #include <string>
+#include <system_error>
 #include <thread>
 #include <csignal>
 #include <atomic>
 
 std::atomic<bool> stop(false);
+std::atomic<bool> dump_statistics(false);
+std::atomic<bool> reload_program(false);
 
 void signal_handler(int) {
     stop.store(true);
 }
 
+void statistics_signal_handler(int) {
+    dump_statistics.store(true);
+}
+
+void reload_signal_handler(int) {
+    reload_program.store(true);
+}
+
+//! Reads a sequencer command file or compiled program file; stdin if filename is empty
+std::unique_ptr<sequencer_data> read_program(const std::string& filename)
+{
+    if (!filename.empty() && is_program_file(filename)) {
+        return load_program_file(filename);
+    }
+    nlohmann::json data;
+    if (filename.empty()) {
+        std::cin >> data;
+    } else {
+        data = data.parse(std::ifstream(filename));
+    }
+    return std::make_unique<sequencer_data>(data);
+}
+
+//! Writes the backend's statistics to filename, or to stdout if that's empty
+void write_statistics(const awg_base& awg, const std::string& filename)
+{
+    const auto text = awg.statistics().dump(2);
+    if (filename.empty()) {
+        fmt::print("{}\n", text);
+    } else {
+        std::ofstream(filename) << text << '\n';
+    }
+}
+
 int main(int argc, char* argv[])
 {
     CLI::App app{"Sequencing Multichannel AWG"};
     app.get_formatter()->column_width(50);
 
 
-    std::set<std::string> valid_modes{"host", "rfnoc"};
+    std::set<std::string> valid_modes{"host", "rfnoc", "sim"};
     std::set<std::string> valid_otw_formats{"sc16", "sc8", "sc12"};
     std::string mode{"host"};
     std::string device_address;
     std::string filename;
+    std::string statistics_filename;
+    std::string compile_filename;
+    bool streaming_input = false;
 
     app.add_option("-a,--address", device_address, "Device address to use");
-    app.add_option("-m,--mode", mode, "Mode (host or rfnoc)")
+    app.add_option("-m,--mode", mode, "Mode (host, rfnoc or sim)")
         ->capture_default_str()
         ->transform(CLI::IsMember(valid_modes, CLI::ignore_case));
-    app.add_option("-f,--file", filename, "Sequencer command file; defaults to stdin");
+    app.add_option("-f,--file",
+        filename,
+        "Sequencer command file or compiled program file; defaults to stdin");
+    app.add_option("--compile",
+        compile_filename,
+        "Compile the sequencer command file into this program file and exit");
+    app.add_flag("--stream",
+        streaming_input,
+        "Read the file as a header line (config, segments) followed by one sequence "
+        "point per line, and play the points as they arrive");
+    app.add_option("--stats-file",
+        statistics_filename,
+        "Write statistics as JSON to this file on exit and on SIGUSR1 (default: on "
+        "SIGUSR1 only, to stdout)");
 
     try {
         app.parse(argc, argv);
@@ -47,22 +109,138 @@ int main(int argc, char* argv[])
 
     std::signal(SIGINT, &signal_handler);
 
-    // TODO use mode arg
-    auto awg = awg_factory().make(mode, device_address, stop);
-    nlohmann::json data;
-    if (filename.empty()) {
-        std::cin >> data;
+    std::unique_ptr<sequencer_data> sequencer_d;
+    std::unique_ptr<sequence_input> input;
+    int input_fd = STDIN_FILENO;
+    if (streaming_input) {
+        if (!compile_filename.empty()) {
+            fmt::print(stderr, "--stream and --compile can't be combined\n");
+            return -1;
+        }
+        try {
+            if (!filename.empty()) {
+                input_fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+                if (input_fd < 0) {
+                    throw std::system_error(errno, std::generic_category(), filename);
+                }
+            }
+            input       = std::make_unique<sequence_input>(input_fd, stop);
+            sequencer_d = std::make_unique<sequencer_data>(input->header());
+            input->attach(*sequencer_d);
+        } catch (const std::exception& err) {
+            fmt::print(stderr, FMT_STRING("{}\n"), err.what());
+            return -1;
+        }
     } else {
-        data = data.parse(std::ifstream(filename));
+        try {
+            sequencer_d = read_program(filename);
+        } catch (const std::exception& err) {
+            // e.g. a changed segment file, or an undefined or recursive pattern
+            fmt::print(stderr, FMT_STRING("{}\n"), err.what());
+            return -1;
+        }
+    }
+
+    if (!compile_filename.empty()) {
+        try {
+            write_program_file(*sequencer_d, compile_filename);
+        } catch (const std::exception& err) {
+            fmt::print(stderr, FMT_STRING("{}\n"), err.what());
+            return -1;
+        }
+        fmt::print(FMT_STRING("Wrote program file '{}'\n"), compile_filename);
+        return 0;
+    }
+
+    const bool swappable = sequencer_d->settings.swap.enabled;
+    if (swappable && (streaming_input || filename.empty())) {
+        fmt::print(stderr, "Swapping programs needs a file to reload, and no --stream\n");
+        return -1;
+    }
+    if (swappable && mode == "rfnoc") {
+        fmt::print(stderr, "Swapping programs isn't supported in RFNoC mode\n");
+        return -1;
     }
-    auto sequencer_d = std::make_unique<sequencer_data>(data);
+
+    // TODO use mode arg
+    auto awg = awg_factory().make(mode, device_address, stop);
     if (!awg->load_program(std::move(sequencer_d))) {
         return -1;
     }
+
+    // Feeds the backend from the start; in RFNoC mode, initialize() already plays
+    std::thread input_thread;
+    if (input) {
+        input_thread = std::thread([&input]() {
+            try {
+                input->run();
+            } catch (const std::exception& err) {
+                fmt::print(stderr, FMT_STRING("Sequence input failed: {}\n"), err.what());
+            }
+        });
+    }
+    auto finish_input = [&]() {
+        if (input_thread.joinable()) {
+            stop.store(true);
+            input_thread.join();
+        }
+        if (input_fd != STDIN_FILENO) {
+            ::close(input_fd);
+        }
+    };
+
     if (!awg->initialize()) {
+        finish_input();
         return -2;
     }
-    if(!awg->start()) {
+
+    // Dump statistics whenever SIGUSR1 arrives, while the AWG runs
+#ifdef SIGUSR1
+    std::signal(SIGUSR1, &statistics_signal_handler);
+#endif
+    std::atomic<bool> running(true);
+    std::thread statistics_thread([&]() {
+        while (running.load()) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            if (dump_statistics.exchange(false)) {
+                write_statistics(*awg, statistics_filename);
+            }
+        }
+    });
+    // Reload the file on SIGHUP and swap it in; it's loaded while the old one plays
+    std::thread reload_thread;
+    if (swappable) {
+#ifdef SIGHUP
+        std::signal(SIGHUP, &reload_signal_handler);
+#endif
+        reload_thread = std::thread([&]() {
+            while (running.load()) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                if (!reload_program.exchange(false)) {
+                    continue;
+                }
+                fmt::print(FMT_STRING("Reloading '{}'\n"), filename);
+                try {
+                    awg->swap_program(read_program(filename));
+                } catch (const std::exception& err) {
+                    fmt::print(stderr,
+                        FMT_STRING("Not swapping programs: {}\n"),
+                        err.what());
+                }
+            }
+        });
+    }
+    const bool started = awg->start();
+    running.store(false);
+    statistics_thread.join();
+    if (reload_thread.joinable()) {
+        reload_thread.join();
+    }
+    finish_input();
+    if (!statistics_filename.empty()) {
+        write_statistics(*awg, statistics_filename);
+    }
+    if(!started) {
         return -3;
     }
     return 0;
@@ -0,0 +1,107 @@
+/*
+ * Copyright 2023 Ettus Research, A National Instruments Brand
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+#include "multichannel_awg/mapped_file.hpp"
+#include <fmt/format.h>
+#include <cerrno>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+mapped_file::mapped_file(
+    const std::string& filename, prefault_e prefault, bool lock, bool read_once)
+{
+    const int fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        throw std::system_error(errno, std::generic_category(), "open " + filename);
+    }
+    struct stat info;
+    if (::fstat(fd, &info) != 0) {
+        const int err = errno;
+        ::close(fd);
+        throw std::system_error(err, std::generic_category(), "stat " + filename);
+    }
+    length = static_cast<size_t>(info.st_size);
+    if (length == 0) {
+        ::close(fd);
+        return;
+    }
+
+    int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+    if (prefault == prefault_e::POPULATE) {
+        flags |= MAP_POPULATE;
+    }
+#endif
+    addr = ::mmap(nullptr, length, PROT_READ, flags, fd, 0);
+    const int err = errno;
+    // The mapping keeps its own reference to the file
+    ::close(fd);
+    if (addr == MAP_FAILED) {
+        addr = nullptr;
+        throw std::system_error(err, std::generic_category(), "mmap " + filename);
+    }
+
+    // Looped segments are played from the mapping many times; their pages must stay
+    if (read_once) {
+        ::madvise(addr, length, MADV_SEQUENTIAL);
+    }
+    if (prefault == prefault_e::WILLNEED) {
+        ::madvise(addr, length, MADV_WILLNEED);
+    }
+    if (lock) {
+        if (::mlock(addr, length) == 0) {
+            is_locked = true;
+        } else {
+            fmt::print(stderr,
+                FMT_STRING("Could not lock {:L} B of '{}' in memory ({}); check "
+                           "RLIMIT_MEMLOCK\n"),
+                length,
+                filename,
+                std::generic_category().message(errno));
+        }
+    }
+}
+
+mapped_file::mapped_file(mapped_file&& other) noexcept
+    : addr(std::exchange(other.addr, nullptr))
+    , length(std::exchange(other.length, 0))
+    , is_locked(std::exchange(other.is_locked, false))
+{
+}
+
+mapped_file& mapped_file::operator=(mapped_file&& other) noexcept
+{
+    if (this != &other) {
+        release();
+        addr      = std::exchange(other.addr, nullptr);
+        length    = std::exchange(other.length, 0);
+        is_locked = std::exchange(other.is_locked, false);
+    }
+    return *this;
+}
+
+mapped_file::~mapped_file()
+{
+    release();
+}
+
+void mapped_file::release()
+{
+    if (addr) {
+        if (is_locked) {
+            ::munlock(addr, length);
+        }
+        ::munmap(addr, length);
+    }
+    addr      = nullptr;
+    length    = 0;
+    is_locked = false;
+}
@@ -7,6 +7,7 @@
 #include "multichannel_awg/multichannel_awg.hpp"
 #include "multichannel_awg/host_awg.hpp"
 #include "multichannel_awg/rfnoc_awg.hpp"
+#include "multichannel_awg/sim_awg.hpp"
 // TODO include rfnoc awg
 #include <memory>
 #include <stdexcept>
@@ -19,6 +20,8 @@ std::unique_ptr<awg_base> awg_factory::make(
         return std::unique_ptr<awg_base>(new host_awg(address, stop));
     } else if (name == "rfnoc") {
         return std::unique_ptr<awg_base>(new rfnoc_awg(address, stop));
+    } else if (name == "sim") {
+        return std::unique_ptr<awg_base>(new sim_awg(address, stop));
     } else {
         throw std::runtime_error("factory for mode \"" + name + "\" not implemented");
     }
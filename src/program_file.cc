@@ -0,0 +1,294 @@
+/*
+ * Copyright 2023 Ettus Research, A National Instruments Brand
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+#include "multichannel_awg/program_file.hpp"
+#include "multichannel_awg/mapped_file.hpp"
+#include "multichannel_awg/sequence.hpp"
+#include "multichannel_awg/timeline.hpp"
+#include <nlohmann/json.hpp>
+#include <fmt/format.h>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace {
+constexpr uint64_t ALIGNMENT = 8;
+
+uint64_t aligned(uint64_t offset)
+{
+    return (offset + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+}
+
+//! writes size bytes, padded to ALIGNMENT; returns the offset they were written at
+uint64_t write_section(std::ofstream& out, const void* data, uint64_t size)
+{
+    static constexpr char padding[ALIGNMENT] = {};
+    const auto offset = static_cast<uint64_t>(out.tellp());
+    out.write(static_cast<const char*>(data), static_cast<std::streamsize>(size));
+    out.write(padding, static_cast<std::streamsize>(aligned(size) - size));
+    return offset;
+}
+
+//! pointer to count records of T at offset, after checking they lie within the file
+template <typename T>
+const T* section(const mapped_file& file, uint64_t offset, uint64_t count)
+{
+    if (offset % alignof(T) != 0 || offset > file.size()
+        || count > (file.size() - offset) / sizeof(T)) {
+        throw std::runtime_error("Corrupt program file: section out of bounds");
+    }
+    return reinterpret_cast<const T*>(file.data() + offset);
+}
+} // namespace
+
+bool is_program_file(const std::string& filename)
+{
+    char magic[sizeof(program_file_header::MAGIC)] = {};
+    std::ifstream(filename, std::ios::binary).read(magic, sizeof(magic));
+    return std::memcmp(magic, program_file_header::MAGIC, sizeof(magic)) == 0;
+}
+
+void write_program_file(const sequencer_data& data, const std::string& filename)
+{
+    const auto& program = data.program;
+
+    std::string strings;
+    std::vector<program_file_segment> segments;
+    auto add_string = [&strings](const std::string& str) {
+        const auto offset = static_cast<uint32_t>(strings.size());
+        strings += str;
+        return offset;
+    };
+    std::map<std::string, uint32_t> index;
+    for (const auto* sspec : program.segments) {
+        index.emplace(sspec->name, static_cast<uint32_t>(index.size()));
+    }
+    for (const auto* sspec : program.segments) {
+        program_file_segment record{};
+        record.length = sspec->length;
+        record.base   = program_file_segment::NO_BASE;
+        if (sspec->derived) {
+            record.base      = index.at(sspec->derived->base);
+            record.offset    = sspec->derived->offset;
+            record.gain      = sspec->derived->gain;
+            record.frequency = sspec->derived->frequency;
+            record.phase     = sspec->derived->phase;
+        } else {
+            record.file_size = std::filesystem::file_size(sspec->filename);
+        }
+        record.name_offset     = add_string(sspec->name);
+        record.name_size       = static_cast<uint32_t>(sspec->name.size());
+        record.filename_offset = add_string(sspec->filename);
+        record.filename_size   = static_cast<uint32_t>(sspec->filename.size());
+        record.streamed        = sspec->streamed ? 1 : 0;
+        segments.push_back(record);
+    }
+
+    // Entries are written channel by channel, then block by block, so they needn't be
+    // contiguous in memory
+    std::vector<program_file_channel> channels;
+    uint64_t num_entries = 0;
+    for (const auto& [channel, timeline] : program.channels) {
+        channels.push_back({channel, num_entries, timeline.size()});
+        num_entries += timeline.size();
+    }
+    std::vector<program_file_channel> blocks;
+    for (const auto& block : program.blocks) {
+        blocks.push_back({blocks.size(), num_entries, block.size()});
+        num_entries += block.size();
+    }
+
+    std::ofstream out(filename, std::ios::binary | std::ios::trunc);
+    if (!out) {
+        throw std::runtime_error("Could not open " + filename + " for writing");
+    }
+    program_file_header header{};
+    // placeholder; rewritten with all offsets at the end
+    write_section(out, &header, sizeof(header));
+
+    std::memcpy(header.magic, program_file_header::MAGIC, sizeof(header.magic));
+    header.version    = program_file_header::VERSION;
+    header.byte_order = program_file_header::BYTE_ORDER_MARK;
+    header.entry_size = sizeof(timeline_entry);
+
+    const std::string config = data.config.dump();
+    header.config_size       = config.size();
+    header.config_offset     = write_section(out, config.data(), config.size());
+    header.strings_size      = strings.size();
+    header.strings_offset    = write_section(out, strings.data(), strings.size());
+    header.num_segments      = segments.size();
+    header.segments_offset   = write_section(
+        out, segments.data(), segments.size() * sizeof(program_file_segment));
+    header.num_channels    = channels.size();
+    header.channels_offset = write_section(
+        out, channels.data(), channels.size() * sizeof(program_file_channel));
+    header.num_blocks    = blocks.size();
+    header.blocks_offset = write_section(
+        out, blocks.data(), blocks.size() * sizeof(program_file_channel));
+    header.num_entries    = num_entries;
+    header.entries_offset = static_cast<uint64_t>(out.tellp());
+    for (const auto& [channel, timeline] : program.channels) {
+        out.write(reinterpret_cast<const char*>(timeline.data()),
+            static_cast<std::streamsize>(timeline.size_bytes()));
+    }
+    for (const auto& block : program.blocks) {
+        out.write(reinterpret_cast<const char*>(block.data()),
+            static_cast<std::streamsize>(block.size_bytes()));
+    }
+
+    out.seekp(0);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    if (!out.flush()) {
+        throw std::runtime_error("Could not write " + filename);
+    }
+}
+
+std::unique_ptr<sequencer_data> load_program_file(const std::string& filename)
+{
+    mapped_file file(filename, prefault_e::WILLNEED, false);
+    const auto& header = *section<program_file_header>(file, 0, 1);
+    if (std::memcmp(header.magic, program_file_header::MAGIC, sizeof(header.magic)) != 0
+        || header.byte_order != program_file_header::BYTE_ORDER_MARK) {
+        throw std::runtime_error(filename + " is not a program file for this machine");
+    }
+    if (header.version != program_file_header::VERSION
+        || header.entry_size != sizeof(timeline_entry)) {
+        throw std::runtime_error(fmt::format(
+            FMT_STRING("{}: program file version {} isn't supported; recompile it"),
+            filename,
+            header.version));
+    }
+
+    const auto* config_text = section<char>(file, header.config_offset, header.config_size);
+    const auto config       = nlohmann::json::parse(
+        config_text, config_text + header.config_size);
+    auto data = std::make_unique<sequencer_data>(config, config.get<device_settings>());
+
+    const auto* strings = section<char>(file, header.strings_offset, header.strings_size);
+    auto string_at      = [&](uint32_t offset, uint32_t size) {
+        if (static_cast<uint64_t>(offset) + size > header.strings_size) {
+            throw std::runtime_error("Corrupt program file: string out of bounds");
+        }
+        return std::string(strings + offset, size);
+    };
+    const auto itemsize = static_cast<size_t>(data->settings.cpu_format);
+    const std::span<const program_file_segment> segments(
+        section<program_file_segment>(file, header.segments_offset, header.num_segments),
+        header.num_segments);
+    for (size_t idx = 0; idx < segments.size(); ++idx) {
+        const auto& record = segments[idx];
+        const auto name     = string_at(record.name_offset, record.name_size);
+        if (record.base != program_file_segment::NO_BASE) {
+            // Following the bases has to end at a file segment within as many steps as
+            // there are segments, and every slice has to fit into its base
+            const auto* derived = &record;
+            for (size_t steps = 0; derived->base != program_file_segment::NO_BASE;
+                 ++steps) {
+                if (derived->base >= segments.size() || steps == segments.size()
+                    || derived->offset > segments[derived->base].length
+                    || derived->length
+                           > segments[derived->base].length - derived->offset) {
+                    throw std::runtime_error(
+                        "Corrupt program file: derived segment out of bounds");
+                }
+                derived = &segments[derived->base];
+            }
+            const auto& base = segments[record.base];
+            const segment_derivation derivation{
+                .base      = string_at(base.name_offset, base.name_size),
+                .offset    = record.offset,
+                .gain      = record.gain,
+                .frequency = record.frequency,
+                .phase     = record.phase};
+            auto [spec, inserted] = data->filemap.emplace(name,
+                segment_spec{.name = name,
+                    .filename      = std::string{},
+                    .length        = record.length,
+                    .itemsize      = itemsize,
+                    .start_idx     = static_cast<size_t>(-1),
+                    .data          = nullptr,
+                    .streamed      = false,
+                    .derived       = derivation});
+            data->program.segments.push_back(&spec->second);
+            continue;
+        }
+        const auto sample_file = string_at(record.filename_offset, record.filename_size);
+        if (!std::filesystem::exists(sample_file)
+            || std::filesystem::file_size(sample_file) != record.file_size) {
+            throw std::runtime_error(fmt::format(
+                FMT_STRING("Segment '{}': '{}' is missing or changed since the program "
+                           "was compiled"),
+                name,
+                sample_file));
+        }
+        auto [spec, inserted] = data->filemap.emplace(name,
+            segment_spec{.name = name,
+                .filename      = sample_file,
+                .length        = record.length,
+                .itemsize      = itemsize,
+                .start_idx     = static_cast<size_t>(-1),
+                .data          = nullptr,
+                .streamed      = record.streamed != 0,
+                .derived       = std::nullopt});
+        data->program.segments.push_back(&spec->second);
+    }
+
+    auto& program         = data->program;
+    program.sampling_rate = data->settings.sampling_rate;
+    const std::span<const timeline_entry> entries(
+        section<timeline_entry>(file, header.entries_offset, header.num_entries),
+        header.num_entries);
+    // A block only contains blocks before it, so that the nesting is finite
+    auto entries_of = [&](const program_file_channel& record, uint64_t max_block) {
+        if (record.first_entry > entries.size()
+            || record.num_entries > entries.size() - record.first_entry) {
+            throw std::runtime_error("Corrupt program file: timeline out of bounds");
+        }
+        const auto timeline = entries.subspan(record.first_entry, record.num_entries);
+        for (const auto& entry : timeline) {
+            if (entry.block == timeline_entry::NO_BLOCK
+                    ? entry.segment >= program.segments.size()
+                    : entry.block >= max_block) {
+                throw std::runtime_error("Corrupt program file: segment or block out of bounds");
+            }
+        }
+        return timeline;
+    };
+    const std::span<const program_file_channel> blocks(
+        section<program_file_channel>(file, header.blocks_offset, header.num_blocks),
+        header.num_blocks);
+    for (const auto& record : blocks) {
+        if (record.num_entries == 0) {
+            throw std::runtime_error("Corrupt program file: empty block");
+        }
+        program.blocks.push_back(entries_of(record, program.blocks.size()));
+    }
+    const std::span<const program_file_channel> channels(
+        section<program_file_channel>(file, header.channels_offset, header.num_channels),
+        header.num_channels);
+    for (const auto& record : channels) {
+        program.channels[record.channel] = entries_of(record, program.blocks.size());
+    }
+    program.file = std::move(file);
+    data->mark_referenced();
+
+    fmt::print(FMT_STRING("Loaded program file '{}': {} segments, {} channels, {} "
+                          "blocks, {} timeline entries\n"),
+        filename,
+        header.num_segments,
+        header.num_channels,
+        header.num_blocks,
+        header.num_entries);
+    return data;
+}
@@ -0,0 +1,175 @@
+/*
+ * Copyright 2023 Ettus Research, A National Instruments Brand
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+#include "multichannel_awg/replay_memory.hpp"
+#include "multichannel_awg/segment_store.hpp"
+#include <uhd/exception.hpp>
+#include <fmt/format.h>
+#include <algorithm>
+#include <atomic>
+#include <numeric>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+replay_memory::replay_memory(
+    std::string name, uint64_t mem_size, uint64_t word_size, size_t wire_itemsize)
+    : name(std::move(name))
+    , mem_size(mem_size)
+    , word_size(std::max<uint64_t>(word_size, 1))
+    , wire_itemsize(wire_itemsize)
+{
+}
+
+void replay_memory::allocate(const std::vector<const segment_spec*>& segments,
+    const sequencer_data::filemap_t& filemap)
+{
+    std::vector<const segment_spec*> own;
+    // slices that can share their root's memory, with their offset into it in bytes
+    std::vector<std::tuple<const segment_spec*, const segment_spec*, uint64_t>> slices;
+    for (const auto* seg : segments) {
+        if (addresses.contains(seg)) {
+            continue;
+        }
+        // The play buffer is one repetition, which must be whole words
+        if (seg->length * wire_itemsize % word_size != 0) {
+            throw uhd::value_error(fmt::format(
+                FMT_STRING("{}: segment '{}' has {} samples, which isn't a multiple of the "
+                           "memory word size ({} samples); pad it to play it"),
+                name,
+                seg->name,
+                seg->length,
+                word_size / std::gcd<uint64_t>(word_size, wire_itemsize)));
+        }
+        if (!seg->is_view()) {
+            own.push_back(seg);
+            continue;
+        }
+        uint64_t offset          = 0;
+        const segment_spec* root = seg;
+        while (root->is_view()) {
+            offset += root->derived->offset;
+            root = &filemap.at(root->derived->base);
+        }
+        if (offset * wire_itemsize % word_size == 0) {
+            slices.emplace_back(seg, root, offset * wire_itemsize);
+            if (!addresses.contains(root)) {
+                own.push_back(root);
+            }
+        } else {
+            // Can't be played from within its base; store its samples separately
+            own.push_back(seg);
+        }
+    }
+
+    // Biggest first, so that the layout doesn't depend on the order of requests
+    std::sort(own.begin(), own.end(), [](const auto* lhs, const auto* rhs) {
+        return std::tie(rhs->length, lhs->name) < std::tie(lhs->length, rhs->name);
+    });
+    own.erase(std::unique(own.begin(), own.end()), own.end());
+
+    uint64_t end = used();
+    for (const auto* seg : own) {
+        if (addresses.contains(seg)) {
+            continue;
+        }
+        const uint64_t size = seg->length * wire_itemsize;
+        placed.push_back({seg, end, size, align(size) - size});
+        addresses.emplace(seg, end);
+        end += align(size);
+    }
+    if (end > mem_size) {
+        throw uhd::runtime_error(fmt::format(
+            FMT_STRING("Total segments memory usage exceeds {}'s memory size. Used: {}, "
+                       "Available: {}"),
+            name,
+            end,
+            mem_size));
+    }
+
+    for (const auto& [seg, root, offset] : slices) {
+        addresses.emplace(seg, addresses.at(root) + offset);
+        ++shared;
+    }
+}
+
+uint64_t replay_memory::address(const segment_spec& seg) const
+{
+    const auto found = addresses.find(&seg);
+    if (found == addresses.end()) {
+        throw uhd::lookup_error(fmt::format(
+            FMT_STRING("Segment '{}' isn't stored in {}"), seg.name, name));
+    }
+    return found->second;
+}
+
+uint64_t replay_memory::used() const
+{
+    return placed.empty() ? 0 : placed.back().address + align(placed.back().size);
+}
+
+nlohmann::json replay_memory::describe(float scale) const
+{
+    std::vector<uint64_t> hashes(placed.size());
+    std::atomic<size_t> next{0};
+    std::vector<std::thread> workers;
+    const size_t num_threads =
+        std::min<size_t>(placed.size(), std::max(std::thread::hardware_concurrency(), 1u));
+    for (size_t thread = 0; thread < num_threads; ++thread) {
+        workers.emplace_back([&]() {
+            for (size_t idx = next++; idx < placed.size(); idx = next++) {
+                const auto& seg = *placed[idx].segment;
+                hashes[idx]     = content_hash(seg.data, seg.length * seg.itemsize);
+            }
+        });
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+
+    auto segments = nlohmann::json::array();
+    for (size_t idx = 0; idx < placed.size(); ++idx) {
+        const auto& alloc = placed[idx];
+        segments.push_back({{"address", alloc.address},
+            {"size", alloc.size},
+            {"itemsize", alloc.segment->itemsize},
+            {"hash", fmt::format(FMT_STRING("{:016x}"), hashes[idx])}});
+    }
+    return {{"word_size", word_size},
+        {"mem_size", mem_size},
+        {"wire_itemsize", wire_itemsize},
+        {"scale", scale},
+        {"segments", segments}};
+}
+
+void replay_memory::print_report() const
+{
+    uint64_t samples = 0;
+    uint64_t padding = 0;
+    for (const auto& alloc : placed) {
+        samples += alloc.size;
+        padding += alloc.padding;
+    }
+    const uint64_t headroom = mem_size - used();
+    fmt::print(FMT_STRING("{}: {} segments stored ({} more sharing their memory), {} of "
+                          "{} bytes used ({:.3f}%)\n"),
+        name,
+        placed.size(),
+        shared,
+        used(),
+        mem_size,
+        mem_size ? 100.0 * static_cast<double>(used()) / static_cast<double>(mem_size)
+                 : 0.0);
+    fmt::print(FMT_STRING("{}: {} bytes of samples, {} bytes of word alignment padding "
+                          "({:.3f}% fragmentation), {} bytes free in one piece\n"),
+        name,
+        samples,
+        padding,
+        used() ? 100.0 * static_cast<double>(padding) / static_cast<double>(used()) : 0.0,
+        headroom);
+}
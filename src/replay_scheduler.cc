@@ -0,0 +1,197 @@
+/*
+ * Copyright 2023 Ettus Research, A National Instruments Brand
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+#include "multichannel_awg/replay_scheduler.hpp"
+#include <uhd/exception.hpp>
+#include <fmt/format.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <numeric>
+#include <string>
+#include <vector>
+
+namespace {
+//! smallest power of ten that turns value into an integer, up to 1e6 (i.e. µHz)
+double integer_scale(double value)
+{
+    double scale = 1.0;
+    while (scale < 1e6 && std::abs(value * scale - std::round(value * scale)) > 1e-6) {
+        scale *= 10.0;
+    }
+    return scale;
+}
+} // namespace
+
+replay_scheduler::replay_scheduler(
+    double sampling_rate, double radio_rate, double start_offset)
+    : radio_rate(radio_rate)
+{
+    if (sampling_rate <= 0.0 || radio_rate <= 0.0) {
+        throw uhd::value_error(fmt::format(
+            FMT_STRING("Invalid rates for scheduling: sampling rate {}, radio rate {}"),
+            sampling_rate,
+            radio_rate));
+    }
+    const double scale = std::max(integer_scale(sampling_rate), integer_scale(radio_rate));
+    num = static_cast<uint64_t>(std::llround(radio_rate * scale));
+    den = static_cast<uint64_t>(std::llround(sampling_rate * scale));
+    const uint64_t divisor = std::gcd(num, den);
+    num /= divisor;
+    den /= divisor;
+    offset_ticks = std::llround(start_offset * radio_rate);
+}
+
+uint64_t replay_scheduler::radio_tick(uint64_t sample_tick) const
+{
+    // split, so that sample_tick * num can't overflow
+    return sample_tick / den * num + sample_tick % den * num / den;
+}
+
+uhd::time_spec_t replay_scheduler::time_spec(const replay_command& cmd) const
+{
+    return uhd::time_spec_t::from_ticks(
+        offset_ticks + static_cast<long long>(cmd.radio_tick), radio_rate);
+}
+
+size_t replay_scheduler::verify(
+    size_t channel, replay_command_source source, size_t max_reports) const
+{
+    size_t violations = 0;
+    auto report       = [&](size_t idx, const replay_command& cmd, const std::string& what) {
+        if (violations++ < max_reports) {
+            fmt::print(stderr,
+                FMT_STRING("Channel {}, command {} (sample {}): {}\n"),
+                channel,
+                idx,
+                cmd.sample_tick,
+                what);
+        }
+    };
+
+    // Commands are checked against their predecessor only, so any number of them can
+    // be checked without storing them
+    replay_command prev{};
+    replay_command cmd{};
+    long long previous_end = 0;
+    size_t idx             = 0;
+    for (; source.next(cmd); ++idx) {
+        const long long tick = time_spec(cmd).to_ticks(radio_rate) - offset_ticks;
+        if (tick != static_cast<long long>(cmd.radio_tick)) {
+            report(idx,
+                cmd,
+                fmt::format(FMT_STRING("issued at radio tick {} instead of {}"),
+                    tick,
+                    cmd.radio_tick));
+        }
+        if (idx > 0) {
+            const uint64_t prev_end_sample = prev.sample_tick + prev.num_samps;
+            if (cmd.sample_tick < prev_end_sample) {
+                report(idx,
+                    cmd,
+                    fmt::format(FMT_STRING("overlaps the previous command by {} samples"),
+                        prev_end_sample - cmd.sample_tick));
+            } else if (cmd.sample_tick == prev_end_sample) {
+                if (prev.num_samps % den * num % den != 0) {
+                    report(idx - 1,
+                        prev,
+                        fmt::format(FMT_STRING("{} samples are not a whole number of "
+                                               "radio ticks"),
+                            prev.num_samps));
+                }
+                if (tick != previous_end) {
+                    report(idx,
+                        cmd,
+                        fmt::format(FMT_STRING("starts at radio tick {}, but the "
+                                               "previous command ends at {}"),
+                            tick,
+                            previous_end));
+                }
+            }
+        }
+        // The device ends this command at its issued start plus its duration
+        previous_end = tick + static_cast<long long>(radio_tick(cmd.num_samps));
+        prev         = cmd;
+    }
+
+    if (violations > max_reports) {
+        fmt::print(stderr,
+            FMT_STRING("Channel {}: {} more schedule violations not shown\n"),
+            channel,
+            violations - max_reports);
+    }
+    fmt::print(FMT_STRING("Channel {}: verified {} Replay commands, {} violations{}\n"),
+        channel,
+        idx,
+        violations,
+        source.truncated() ? fmt::format(FMT_STRING(" (loops checked for {} passes; "
+                                                    "further passes repeat them)"),
+                                 VERIFIED_PASSES)
+                           : "");
+    return violations;
+}
+
+replay_command_source::replay_command_source(const replay_scheduler& scheduler,
+    const compiled_program& program,
+    std::span<const timeline_entry> timeline,
+    bool last,
+    uint64_t max_samps,
+    uint64_t max_passes)
+    : scheduler(&scheduler)
+    , cursor(program, timeline, max_passes)
+    , max_samps(max_samps)
+    , last(last)
+{
+    has_lookahead = expand(lookahead);
+}
+
+bool replay_command_source::next(replay_command& cmd)
+{
+    if (!has_lookahead) {
+        return false;
+    }
+    cmd           = lookahead;
+    has_lookahead = expand(lookahead);
+    if (!has_lookahead && last
+        && cmd.mode == uhd::stream_cmd_t::STREAM_MODE_NUM_SAMPS_AND_MORE) {
+        cmd.mode = uhd::stream_cmd_t::STREAM_MODE_NUM_SAMPS_AND_DONE;
+    }
+    return true;
+}
+
+bool replay_command_source::expand(replay_command& cmd)
+{
+    if (!has_entry || (entry.repeat_count != timeline_entry::FOREVER
+                          && rep == entry.repeat_count)) {
+        if (!cursor.next(entry)) {
+            has_entry = false;
+            return false;
+        }
+        has_entry = true;
+        rep       = 0;
+    }
+    if (entry.repeat_count == timeline_entry::FOREVER) {
+        // Nothing follows an endless entry
+        has_entry = false;
+        cmd       = {entry,
+            entry.start_tick,
+            entry.length,
+            scheduler->radio_tick(entry.start_tick),
+            uhd::stream_cmd_t::STREAM_MODE_START_CONTINUOUS};
+        return true;
+    }
+    // As many whole repetitions as fit into one command, but at least one
+    const uint64_t reps =
+        std::clamp<uint64_t>(max_samps / entry.length, 1, entry.repeat_count - rep);
+    const uint64_t tick = entry.start_tick + rep * entry.length;
+    rep += reps;
+    cmd = {entry,
+        tick,
+        entry.length * reps,
+        scheduler->radio_tick(tick),
+        uhd::stream_cmd_t::STREAM_MODE_NUM_SAMPS_AND_MORE};
+    return true;
+}
@@ -6,25 +6,105 @@
  */
 #include "multichannel_awg/rfnoc_awg.hpp"
 #include "fmt/core.h"
+#include "multichannel_awg/convert.hpp"
 #include "multichannel_awg/multichannel_awg.hpp"
+#include "multichannel_awg/replay_scheduler.hpp"
+#include "multichannel_awg/segment_store.hpp"
 #include "multichannel_awg/sequence.hpp"
 #include <uhd/exception.hpp>
 #include <uhd/stream.hpp>
 #include <uhd/types/metadata.hpp>
 #include <uhd/types/time_spec.hpp>
+#include <uhd/usrp/mboard_eeprom.hpp>
 #include <fmt/format.h>
 #include <algorithm>
+#include <array>
 //#include <cmath>
+#include <cctype>
 #include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
 //#include <cstddef>
 //#include <cstdio>
 #include <filesystem>
 #include <fstream>
+#include <functional>
+#include <future>
+#include <map>
+#include <set>
 //#include <future>
 //#include <memory>
 #include <string>
 #include <thread>
+#include <tuple>
 #include <utility>
+#include <vector>
+
+namespace {
+//! \brief marks the segments that entries play, following loops into their blocks
+void collect_played(const compiled_program& program,
+    std::span<const timeline_entry> entries,
+    std::vector<bool>& played,
+    std::vector<bool>& visited)
+{
+    for (const auto& entry : entries) {
+        if (entry.block == timeline_entry::NO_BLOCK) {
+            played[entry.segment] = true;
+        } else if (!visited[entry.block]) {
+            visited[entry.block] = true;
+            collect_played(program, program.blocks[entry.block], played, visited);
+        }
+    }
+}
+
+/*!
+ * \brief File that records what was last uploaded to a Replay block
+ *
+ * In dir, or in the user's cache directory if dir is empty; named after the device
+ * (its serial number, where known) and the block.
+ */
+std::filesystem::path manifest_path(
+    const std::string& dir, const std::string& device, const std::string& block)
+{
+    std::filesystem::path base = dir;
+    if (base.empty()) {
+        const char* cache = std::getenv("XDG_CACHE_HOME");
+        const char* home  = std::getenv("HOME");
+        base = (cache && *cache) ? std::filesystem::path(cache)
+                                 : std::filesystem::path(home ? home : ".") / ".cache";
+        base /= "multichannel_awg";
+    }
+    std::string name = (device.empty() ? std::string("default") : device) + "_" + block;
+    std::replace_if(name.begin(), name.end(), [](char c) {
+        return !std::isalnum(static_cast<unsigned char>(c)) && c != '.' && c != '-';
+    }, '_');
+    return base / (name + ".json");
+}
+
+//! \brief the manifest at path; null if there is none or it can't be read
+nlohmann::json read_manifest(const std::filesystem::path& path)
+{
+    std::ifstream file(path);
+    if (!file) {
+        return nullptr;
+    }
+    auto manifest = nlohmann::json::parse(file, nullptr, false);
+    return manifest.is_discarded() ? nlohmann::json(nullptr) : manifest;
+}
+
+//! \brief stores manifest at path; failing to do so only costs an upload next time
+void write_manifest(const std::filesystem::path& path, const nlohmann::json& manifest)
+{
+    std::error_code error;
+    std::filesystem::create_directories(path.parent_path(), error);
+    std::ofstream file(path);
+    file << manifest.dump(2) << '\n';
+    if (!file) {
+        fmt::print(stderr, FMT_STRING("Could not write Replay manifest {}\n"), path.string());
+    }
+}
+} // namespace
 
 rfnoc_awg::rfnoc_awg(const std::string& address, const std::atomic<bool>& stop) : awg_base(address, stop) {}
 
@@ -39,30 +119,21 @@ bool rfnoc_awg::load_program(std::unique_ptr<sequencer_data> dat)
 {
     seq_data      = std::move(dat);
     sampling_rate = seq_data->settings.sampling_rate;
-    auto itemsize = static_cast<size_t>(seq_data->settings.cpu_format);
-
-    size_t total_size = 0;
-    for (auto& [id, seg] : seq_data->filemap) {
-        auto length_bytes = std::filesystem::file_size(seg.filename.data());
-        seg.length        = length_bytes / itemsize;
-        total_size += length_bytes;
-    }
-    buffer.resize(total_size);
-
-    size_t currsize = 0;
-    for (auto& [id, seg] : seq_data->filemap) {
-        seg.start_idx       = currsize;
-        seg.data            = buffer.data() + currsize;
-        size_t length_bytes = seg.length * 8;
-        std::ifstream input_file(seg.filename.data(), std::ios::binary);
-        input_file.read(buffer.data() + currsize, length_bytes);
-        currsize += length_bytes;
-        fmt::print(
-            FMT_STRING(
-                "Appended {:L} B of data from file '{}' for segment '{}' to buffer\n"),
-            length_bytes,
-            seg.filename,
-            seg.name);
+
+    for (const auto& [id, seg] : seq_data->filemap) {
+        if (seg.streamed && seg.referenced) {
+            fmt::print(stderr,
+                FMT_STRING("Segment '{}': streaming from disk is only supported in host "
+                           "mode\n"),
+                id);
+            return false;
+        }
+    }
+    try {
+        store.load(seq_data->filemap, seq_data->settings.loading);
+    } catch (const std::exception& err) {
+        fmt::print(stderr, FMT_STRING("{}\n"), err.what());
+        return false;
     }
     return true;
 }
@@ -74,6 +145,7 @@ bool rfnoc_awg::initialize()
         create_graph();
         validate();
         connect_graph();
+        allocate_memory();
         setup_clocking();
         config_rfnoc_blocks();
         sync_dance();
@@ -103,47 +175,9 @@ void rfnoc_awg::validate()
 {
     // The RFNoC implementation has several limitations, this checks each one.
 
-    // Only one USRP device allowed
-    if (graph->get_num_mboards() > 1) {
-        throw uhd::runtime_error("RFNoC implementation only supports one USRP!");
-    }
-
     // Must have a replay block...
-    auto block_id = uhd::rfnoc::block_id_t("Replay#0");
-    if (!graph->has_block(block_id)) {
-        throw uhd::lookup_error(fmt::format(FMT_STRING("Could not find block {}"), block_id.to_string()));
-    }
-    auto replay_ctrl = graph->get_block<uhd::rfnoc::replay_block_control>(block_id);
-
-    // Do not exceed the number of supported channels
-    auto number_of_channels_used = seq_data->used_channels.size();
-    auto number_of_channels_avail = replay_ctrl->get_num_output_ports();
-    if (number_of_channels_used > number_of_channels_avail) {
-        throw uhd::runtime_error(fmt::format(FMT_STRING("Sequences defined for too many channels. Defined: {}, Available: {}"),
-            number_of_channels_used, number_of_channels_avail));
-    }
-
-    // Total segment memory usage cannot exceed the Replay block's available memory
-    if (buffer.size() > replay_ctrl->get_mem_size()) {
-        throw uhd::runtime_error(fmt::format(FMT_STRING("Total segments memory usage exceeds Replay Block's memory size. Used: {}, Available: {}"),
-            buffer.size(), replay_ctrl->get_mem_size()));
-    }
-
-    // Only MAX_NUM_SEQ_POINTS number of sequence points
-    for (const auto& [channel, seq_points] : seq_data->used_channels) {
-        size_t num_seq_points = 0;
-        for (const auto& seq_point : seq_points) {
-            if (seq_point.repetitions > 0) {
-                num_seq_points += seq_point.repetitions;
-            }
-            else {
-                num_seq_points++;
-            }
-        }
-        if (num_seq_points > MAX_NUM_SEQ_POINTS) {
-            throw uhd::runtime_error(fmt::format(FMT_STRING("Total number of sequence points for channel {} exceed the maximum allowed. Number Defined: {}, Maximum Allowed: {}"),
-                channel, num_seq_points, MAX_NUM_SEQ_POINTS));
-        }
+    if (graph->find_blocks("Replay").empty()) {
+        throw uhd::lookup_error("Could not find a Replay block");
     }
 }
 
@@ -164,6 +198,15 @@ void rfnoc_awg::connect_graph()
         graph->connect(
             replay_graph.tx_stream, 0,
             replay_graph.replay_ctrl->get_block_id().to_string(), replay_graph.replay_port);
+        if (!replay_graph.duc_ctrl) {
+            fmt::print(FMT_STRING("Connecting {}:{} to {}:{}\n"),
+                replay_graph.replay_ctrl->get_block_id().to_string(), replay_graph.replay_port,
+                replay_graph.radio_ctrl->get_block_id().to_string(), replay_graph.radio_port);
+            graph->connect(
+                replay_graph.replay_ctrl->get_block_id().to_string(), replay_graph.replay_port,
+                replay_graph.radio_ctrl->get_block_id().to_string(), replay_graph.radio_port);
+            return;
+        }
         fmt::print(FMT_STRING("Connecting {}:{} to {}:{}\n"),
             replay_graph.replay_ctrl->get_block_id().to_string(), replay_graph.replay_port,
             replay_graph.duc_ctrl->get_block_id().to_string(), replay_graph.duc_port);
@@ -178,59 +221,44 @@ void rfnoc_awg::connect_graph()
             replay_graph.radio_ctrl->get_block_id().to_string(), replay_graph.radio_port);
     };
 
-    // WARNING: This is hardcoded for the X410 default image.
-    for (const auto& [channel, sp] : seq_data->used_channels) {
-        replay_graph_config replay_graph;
-        switch (channel) {
-            case 0:
-                replay_graph = {
-                    .replay_port = 0,
-                    .duc_port    = 0,
-                    .radio_port  = 0,
-                    .tx_stream   = graph->create_tx_streamer(1, uhd::stream_args_t("fc32", "sc16")),
-                    .replay_ctrl = graph->get_block<uhd::rfnoc::replay_block_control>(check_block("Replay#0")),
-                    .duc_ctrl    = graph->get_block<uhd::rfnoc::duc_block_control>(check_block("DUC#0")),
-                    .radio_ctrl  = graph->get_block<uhd::rfnoc::radio_control>(check_block("Radio#0"))
-                };
-                break;
-            case 1:
-                replay_graph = {
-                    .replay_port = 1,
-                    .duc_port    = 1,
-                    .radio_port  = 1,
-                    .tx_stream   = graph->create_tx_streamer(1, uhd::stream_args_t("fc32", "sc16")),
-                    .replay_ctrl = graph->get_block<uhd::rfnoc::replay_block_control>(check_block("Replay#0")),
-                    .duc_ctrl    = graph->get_block<uhd::rfnoc::duc_block_control>(check_block("DUC#0")),
-                    .radio_ctrl  = graph->get_block<uhd::rfnoc::radio_control>(check_block("Radio#0"))
-                };
-                break;
-            case 2:
-                replay_graph = {
-                    .replay_port = 2,
-                    .duc_port    = 0,
-                    .radio_port  = 0,
-                    .tx_stream   = graph->create_tx_streamer(1, uhd::stream_args_t("fc32", "sc16")),
-                    .replay_ctrl = graph->get_block<uhd::rfnoc::replay_block_control>(check_block("Replay#0")),
-                    .duc_ctrl    = graph->get_block<uhd::rfnoc::duc_block_control>(check_block("DUC#1")),
-                    .radio_ctrl  = graph->get_block<uhd::rfnoc::radio_control>(check_block("Radio#1"))
-                };
-                break;
-            case 3:
-                replay_graph = {
-                    .replay_port = 3,
-                    .duc_port    = 1,
-                    .radio_port  = 1,
-                    .tx_stream   = graph->create_tx_streamer(1, uhd::stream_args_t("fc32", "sc16")),
-                    .replay_ctrl = graph->get_block<uhd::rfnoc::replay_block_control>(check_block("Replay#0")),
-                    .duc_ctrl    = graph->get_block<uhd::rfnoc::duc_block_control>(check_block("DUC#1")),
-                    .radio_ctrl  = graph->get_block<uhd::rfnoc::radio_control>(check_block("Radio#1"))
-                };
-                break;
-            default:
-                throw uhd::runtime_error(fmt::format("Invalid channel {} in sequence point", channel));
-                break;
+    // Channel n plays through the n-th chain of the image, unless configured otherwise
+    const auto discovered = discover_chains();
+    const auto& configured = seq_data->settings.rfnoc.channels;
+    std::set<std::pair<std::string, size_t>> used_ports;
+    for (const auto& [channel, timeline] : seq_data->program.channels) {
+        const auto override = configured.find(channel);
+        if (override == configured.end() && channel >= discovered.size()) {
+            throw uhd::runtime_error(fmt::format("Invalid channel {} in sequence point: the FPGA image has {} Replay→Radio chains; configure it in \"rfnoc\": {{\"channels\": …}}", channel, discovered.size()));
         }
-        replay_graphs.emplace(channel, replay_graph);
+        const auto& chain = override != configured.end() ? override->second : discovered[channel];
+        const auto replay_id = check_block(chain.replay);
+        const auto duc_id = chain.duc.empty() ? uhd::rfnoc::block_id_t() : check_block(chain.duc);
+        const auto radio_id = check_block(chain.radio);
+        std::vector<std::pair<std::string, size_t>> ports{{replay_id.to_string(), chain.replay_port}, {radio_id.to_string(), chain.radio_port}};
+        if (!chain.duc.empty()) {
+            ports.emplace_back(duc_id.to_string(), chain.duc_port);
+        }
+        for (const auto& port : ports) {
+            // Blocks can only be connected within one motherboard
+            if (uhd::rfnoc::block_id_t(port.first).get_device_no() != radio_id.get_device_no()) {
+                throw uhd::runtime_error(fmt::format("Channel {}: {} and {} are on different motherboards", channel, port.first, radio_id.to_string()));
+            }
+            if (!used_ports.insert(port).second) {
+                throw uhd::runtime_error(fmt::format("Channel {}: {}:{} is already used by another channel", channel, port.first, port.second));
+            }
+        }
+        fmt::print(FMT_STRING("Channel {}: {}:{} -> {}{}:{}\n"), channel, chain.replay, chain.replay_port,
+            chain.duc.empty() ? std::string() : fmt::format("{}:{} -> ", chain.duc, chain.duc_port),
+            chain.radio, chain.radio_port);
+        replay_graphs.emplace(channel, replay_graph_config{
+            .replay_port = chain.replay_port,
+            .duc_port    = chain.duc_port,
+            .radio_port  = chain.radio_port,
+            .tx_stream   = graph->create_tx_streamer(1, uhd::stream_args_t("sc16", "sc16")),
+            .replay_ctrl = graph->get_block<uhd::rfnoc::replay_block_control>(replay_id),
+            .duc_ctrl    = chain.duc.empty() ? nullptr : graph->get_block<uhd::rfnoc::duc_block_control>(duc_id),
+            .radio_ctrl  = graph->get_block<uhd::rfnoc::radio_control>(radio_id)
+        });
     }
 
     for (const auto& [channel, replay_graph] : replay_graphs) {
@@ -239,17 +267,164 @@ void rfnoc_awg::connect_graph()
     graph->commit();
 }
 
+std::vector<rfnoc_chain> rfnoc_awg::discover_chains()
+{
+    using uhd::rfnoc::block_id_t;
+    const auto edges = graph->enumerate_static_connections();
+    auto is = [](const std::string& block, const std::string& name) {
+        return block_id_t(block).get_block_name() == name;
+    };
+    auto fed_by = [&edges](const std::string& block, size_t port) -> const uhd::rfnoc::graph_edge_t* {
+        for (const auto& edge : edges) {
+            if (edge.dst_blockid == block && edge.dst_port == port) {
+                return &edge;
+            }
+        }
+        return nullptr;
+    };
+
+    // Every radio input that a DUC, a Replay block or a stream endpoint feeds; a Replay
+    // block may be hardwired to either
+    std::vector<rfnoc_chain> chains;
+    for (const auto& edge : edges) {
+        if (!is(edge.dst_blockid, "Radio")) {
+            continue;
+        }
+        rfnoc_chain chain;
+        chain.radio = edge.dst_blockid;
+        chain.radio_port = edge.dst_port;
+        const auto* source = &edge;
+        if (is(source->src_blockid, "DUC")) {
+            chain.duc = source->src_blockid;
+            chain.duc_port = source->src_port;
+            source = fed_by(chain.duc, chain.duc_port);
+        }
+        if (source && is(source->src_blockid, "Replay")) {
+            chain.replay = source->src_blockid;
+            chain.replay_port = source->src_port;
+        } else if (!source || !is(source->src_blockid, "SEP")) {
+            // Something else is hardwired in between
+            continue;
+        }
+        chains.push_back(chain);
+    }
+    std::sort(chains.begin(), chains.end(), [](const auto& lhs, const auto& rhs) {
+        return std::make_pair(block_id_t(lhs.radio), lhs.radio_port) < std::make_pair(block_id_t(rhs.radio), rhs.radio_port);
+    });
+
+    // The other chains get the Replay outputs that aren't hardwired, in order
+    std::set<std::pair<std::string, size_t>> hardwired;
+    for (const auto& chain : chains) {
+        if (!chain.replay.empty()) {
+            hardwired.emplace(chain.replay, chain.replay_port);
+        }
+    }
+    auto replay_blocks = graph->find_blocks("Replay");
+    std::sort(replay_blocks.begin(), replay_blocks.end());
+    // per device, as a Replay block can only feed radios of its own device; taken
+    // round-robin across the device's Replay blocks, to spread the segments and the
+    // playback bandwidth over all of their memories. A block's n-th port in use, hardwired
+    // or not, comes after every block's (n-1)-th.
+    std::map<size_t, std::vector<std::tuple<size_t, size_t, std::string, size_t>>> ranked_ports;
+    for (size_t idx = 0; idx < replay_blocks.size(); ++idx) {
+        const auto& block = replay_blocks[idx];
+        const auto num_ports = graph->get_block(block)->get_num_output_ports();
+        size_t rank = 0;
+        for (size_t port = 0; port < num_ports; ++port) {
+            if (hardwired.contains({block.to_string(), port})) {
+                ++rank;
+            }
+        }
+        for (size_t port = 0; port < num_ports; ++port) {
+            if (!hardwired.contains({block.to_string(), port})) {
+                ranked_ports[block.get_device_no()].emplace_back(rank++, idx, block.to_string(), port);
+            }
+        }
+    }
+    std::map<size_t, std::deque<std::pair<std::string, size_t>>> replay_ports;
+    for (auto& [device, ports] : ranked_ports) {
+        std::sort(ports.begin(), ports.end());
+        for (const auto& [rank, idx, block, port] : ports) {
+            replay_ports[device].emplace_back(block, port);
+        }
+    }
+    for (auto chain = chains.begin(); chain != chains.end();) {
+        auto& free_ports = replay_ports[block_id_t(chain->radio).get_device_no()];
+        if (!chain->replay.empty()) {
+            ++chain;
+        } else if (!free_ports.empty()) {
+            std::tie(chain->replay, chain->replay_port) = free_ports.front();
+            free_ports.pop_front();
+            ++chain;
+        } else {
+            // No Replay output left
+            chain = chains.erase(chain);
+        }
+    }
+    return chains;
+}
+
+void rfnoc_awg::allocate_memory()
+{
+    const auto& program = seq_data->program;
+    const size_t wire_itemsize = static_cast<int>(seq_data->settings.wire_format);
+
+    // Each Replay block stores the segments played by the channels on its ports
+    std::map<std::string, std::vector<bool>> played;
+    for (auto& [channel, replay_graph] : replay_graphs) {
+        const auto& replay_ctrl = replay_graph.replay_ctrl;
+        const auto block = replay_ctrl->get_block_id().to_string();
+        auto& memory = replay_memories.try_emplace(block, block, replay_ctrl->get_mem_size(), replay_ctrl->get_word_size(), wire_itemsize).first->second;
+        replay_graph.memory = &memory;
+
+        auto& segments = played.try_emplace(block, program.segments.size(), false).first->second;
+        if (program.live.contains(channel)) {
+            // Points that arrive later may play any segment
+            for (size_t idx = 0; idx < program.segments.size(); ++idx) {
+                segments[idx] = segments[idx] || program.segments[idx]->referenced;
+            }
+        } else {
+            std::vector<bool> visited(program.blocks.size(), false);
+            collect_played(program, program.channels.at(channel), segments, visited);
+        }
+    }
+
+    for (auto& [block, memory] : replay_memories) {
+        std::vector<const segment_spec*> segments;
+        for (size_t idx = 0; idx < program.segments.size(); ++idx) {
+            if (played.at(block)[idx]) {
+                segments.push_back(program.segments[idx]);
+            }
+        }
+        memory.allocate(segments, seq_data->filemap);
+    }
+}
+
 void rfnoc_awg::config_rfnoc_blocks() {
     size_t settings_index = 0;
-    for (const auto& [channel, seq_points] : seq_data->used_channels) {
+    for (const auto& [channel, timeline] : seq_data->program.channels) {
         // RX Frequency
         auto [rx_freq, dsp_offset] = seq_data->settings.frequencies.at(settings_index);
         replay_graphs.at(channel).radio_ctrl->set_rx_frequency(rx_freq, replay_graphs.at(channel).radio_port);
-        replay_graphs.at(channel).duc_ctrl->set_freq(dsp_offset, replay_graphs.at(channel).duc_port);
 
         // Gain
         replay_graphs.at(channel).radio_ctrl->set_rx_gain(seq_data->settings.gains.at(settings_index), replay_graphs.at(channel).radio_port);
 
+        if (!replay_graphs.at(channel).duc_ctrl) {
+            // Without a DUC, samples are played at the radio's rate, without a DSP offset
+            const double radio_rate = replay_graphs.at(channel).radio_ctrl->get_rate();
+            if (seq_data->settings.sampling_rate != radio_rate) {
+                throw uhd::value_error(fmt::format(FMT_STRING("Channel {} has no DUC, so its sampling rate must be the radio rate {}, not {}"),
+                    channel, radio_rate, seq_data->settings.sampling_rate));
+            }
+            if (dsp_offset != 0.0) {
+                fmt::print(stderr, FMT_STRING("Channel {} has no DUC; ignoring its LO offset of {} Hz\n"), channel, dsp_offset);
+            }
+            settings_index++;
+            continue;
+        }
+        replay_graphs.at(channel).duc_ctrl->set_freq(dsp_offset, replay_graphs.at(channel).duc_port);
+
         // Sampling rate
         replay_graphs.at(channel).duc_ctrl->set_output_rate(replay_graphs.at(channel).radio_ctrl->get_rate(), replay_graphs.at(channel).duc_port);
         replay_graphs.at(channel).duc_ctrl->set_input_rate(seq_data->settings.sampling_rate, replay_graphs.at(channel).duc_port);
@@ -257,145 +432,468 @@ void rfnoc_awg::config_rfnoc_blocks() {
         settings_index++;
     }
 
-    // Load Replay block with segment data, doesn't matter what channel we use
-    const auto replay_graph = replay_graphs[replay_graphs.begin()->first];
-    const auto replay_ctrl = replay_graph.replay_ctrl;
-    const auto tx_stream   = replay_graph.tx_stream;
+    // Load every Replay block with its segments, through the first channel that uses it;
+    // the devices in parallel, as each one has its own link
+    std::map<std::string, const replay_graph_config*> recorders;
+    for (const auto& [channel, timeline] : seq_data->program.channels) {
+        const auto& replay_graph = replay_graphs.at(channel);
+        recorders.try_emplace(replay_graph.memory->name, &replay_graph);
+    }
+    std::map<size_t, std::vector<const replay_graph_config*>> devices;
+    for (const auto& [block, replay_graph] : recorders) {
+        devices[replay_graph->replay_ctrl->get_block_id().get_device_no()].push_back(replay_graph);
+    }
+    std::vector<std::future<void>> loads;
+    for (const auto& [device, blocks] : devices) {
+        loads.push_back(std::async(std::launch::async, [this, &blocks]() {
+            for (const auto* replay_graph : blocks) {
+                load_replay_block(*replay_graph);
+            }
+        }));
+    }
+    for (auto& load : loads) {
+        load.get();
+    }
+    // The Replay blocks play from their own memory from now on
+    fmt::print(FMT_STRING("Freeing {} bytes of host segment data\n"), store.size());
+    store.release(seq_data->filemap);
+}
 
-    const uint64_t replay_buff_addr = 0;
-    const uint64_t replay_buff_size_bytes = buffer.size()/(static_cast<int>(seq_data->settings.cpu_format)/static_cast<int>(seq_data->settings.wire_format));
-    const size_t   send_buff_size_samples = buffer.size()/static_cast<int>(seq_data->settings.cpu_format);
+void rfnoc_awg::load_replay_block(const replay_graph_config& replay_graph)
+{
+    const auto& rfnoc_settings = seq_data->settings.rfnoc;
+    const auto& memory = *replay_graph.memory;
+    // The serial number identifies the device whatever address it's reached at; the
+    // address (which may name several devices) only stands in for it if it's missing
+    const auto& block_id = replay_graph.replay_ctrl->get_block_id();
+    const auto eeprom = graph->get_mb_controller(block_id.get_device_no())->get_eeprom();
+    const auto path = eeprom.has_key("serial")
+        ? manifest_path(rfnoc_settings.manifest_dir, eeprom["serial"], block_id.get_local())
+        : manifest_path(rfnoc_settings.manifest_dir, address, memory.name);
+    nlohmann::json layout;
+    if (rfnoc_settings.reuse_memory) {
+        layout = memory.describe(seq_data->settings.preconvert.scale);
+        if (read_manifest(path) == layout) {
+            memory.print_report();
+            fmt::print(FMT_STRING("{} already holds these segments (see {}); not uploading them again\n"),
+                memory.name, path.string());
+            return;
+        }
+    }
+    // Any upload changes the memory, with or without reuse_memory, so the manifest no
+    // longer describes it (not even if the upload is interrupted)
+    std::error_code error;
+    std::filesystem::remove(path, error);
+    upload_segments(replay_graph);
+    if (rfnoc_settings.reuse_memory) {
+        write_manifest(path, layout);
+    }
+}
 
-    // Display replay configuration
-    fmt::print(FMT_STRING("Segments combined buffer size (bytes): {}\n"), replay_buff_size_bytes);
-    fmt::print(FMT_STRING("Replay block available memory (bytes): {}\n"), replay_ctrl->get_mem_size());
-    fmt::print(FMT_STRING("Replay block memory usage: {:.3f}%\n"), static_cast<float>(replay_buff_size_bytes)/static_cast<float>(replay_ctrl->get_mem_size()));
+void rfnoc_awg::upload_segments(const replay_graph_config& replay_graph)
+{
+    const auto& memory = *replay_graph.memory;
+    const auto& replay_ctrl = replay_graph.replay_ctrl;
+    const auto& tx_stream = replay_graph.tx_stream;
+    const auto replay_port = replay_graph.replay_port;
+    const auto& settings = seq_data->settings;
+    constexpr size_t fc32_itemsize = static_cast<size_t>(dataformat_e::FC_32);
+    constexpr size_t wire_itemsize = static_cast<size_t>(dataformat_e::SC_16);
+    if (settings.wire_format != dataformat_e::SC_16) {
+        throw uhd::value_error("RFNoC mode records segments in sc16 only");
+    }
+
+    const uint64_t replay_buff_addr = 0;
+    const uint64_t replay_buff_size_bytes = memory.used();
+    if (replay_buff_size_bytes == 0) {
+        return;
+    }
+    memory.print_report();
 
     // Ensure Replay block input buffer is flushed
     uint64_t fullness = 0;
     do {
-        replay_ctrl->record_restart();
+        replay_ctrl->record_restart(replay_port);
 
         // Make sure the record buffer doesn't start to fill again
         auto start_time = std::chrono::steady_clock::now();
         do {
-            fullness = replay_ctrl->get_record_fullness();
+            fullness = replay_ctrl->get_record_fullness(replay_port);
             if (fullness != 0)
                 break;
         } while (start_time + std::chrono::milliseconds(250) > std::chrono::steady_clock::now());
     } while (fullness);
 
     // Stream data to replay block
-    replay_ctrl->record(replay_buff_addr, replay_buff_size_bytes);
+    replay_ctrl->record(replay_buff_addr, replay_buff_size_bytes, replay_port);
+    fmt::print(FMT_STRING("Sending {} samples to {}...\n"), replay_buff_size_bytes/wire_itemsize, memory.name);
+    const auto start = std::chrono::steady_clock::now();
+
+    // The memory's contents in address order: every segment, and the alignment padding
+    // after it, which is sent as zeros (segment == nullptr)
+    struct piece
+    {
+        const segment_spec* segment;
+        size_t nsamps;
+    };
+    std::vector<piece> pieces;
+    for (const auto& alloc : memory.allocations()) {
+        pieces.push_back({alloc.segment, alloc.size/wire_itemsize});
+        if (alloc.padding > 0) {
+            pieces.push_back({nullptr, alloc.padding/wire_itemsize});
+        }
+    }
 
+    // Fills a chunk of sc16 samples from the pieces, converting fc32 ones. Without
+    // saturation, the first out of range value fails the upload before its chunk is sent
+    const size_t chunk_samps = std::max<size_t>(settings.rfnoc.upload_chunk_size/wire_itemsize, 1);
+    size_t piece_idx = 0;
+    size_t piece_pos = 0;
+    size_t clipped = 0;
+    auto fill = [&](std::vector<int16_t>& staging) {
+        size_t filled = 0;
+        while (filled < chunk_samps && piece_idx < pieces.size()) {
+            const auto& next = pieces[piece_idx];
+            const size_t nsamps = std::min(chunk_samps - filled, next.nsamps - piece_pos);
+            int16_t* out = staging.data() + 2*filled;
+            if (!next.segment) {
+                std::fill_n(out, 2*nsamps, int16_t{0});
+            } else if (next.segment->itemsize == fc32_itemsize) {
+                const size_t piece_clipped = convert_fc32_to_sc16(reinterpret_cast<const float*>(next.segment->data) + 2*piece_pos, out, nsamps, settings.preconvert.scale);
+                if (piece_clipped > 0 && !settings.preconvert.saturate) {
+                    throw uhd::value_error(fmt::format(FMT_STRING("{}: segment '{}' has values out of range at scale {}; stopped uploading"),
+                        memory.name, next.segment->name, settings.preconvert.scale));
+                }
+                clipped += piece_clipped;
+            } else {
+                std::memcpy(out, next.segment->data + piece_pos*next.segment->itemsize, nsamps*wire_itemsize);
+            }
+            filled += nsamps;
+            piece_pos += nsamps;
+            if (piece_pos == next.nsamps) {
+                ++piece_idx;
+                piece_pos = 0;
+            }
+        }
+        return filled;
+    };
+
+    // Fails the upload once neither the streamer nor the recording made progress for
+    // upload_timeout seconds
+    const std::chrono::duration<double> timeout(settings.rfnoc.upload_timeout);
+    auto last_progress = std::chrono::steady_clock::now();
+    uint64_t recorded = 0;
+    auto check_progress = [&](bool sent_some) {
+        const uint64_t now_recorded = replay_ctrl->get_record_fullness(replay_port);
+        const auto now = std::chrono::steady_clock::now();
+        if (sent_some || now_recorded > recorded) {
+            last_progress = now;
+        } else if (now - last_progress > timeout) {
+            throw uhd::runtime_error(fmt::format(FMT_STRING("{} only recorded {} of {} bytes; no progress for {} s"),
+                memory.name, now_recorded, replay_buff_size_bytes, settings.rfnoc.upload_timeout));
+        }
+        recorded = now_recorded;
+    };
+
+    // Convert the next chunk while the current one is sent
+    std::array<std::vector<int16_t>, 2> staging;
+    for (auto& buff : staging) {
+        buff.resize(2*chunk_samps);
+    }
     uhd::tx_metadata_t tx_md;
     tx_md.start_of_burst = true;
-    tx_md.end_of_burst   = true;
+    tx_md.end_of_burst   = false;
+    uint64_t sent_bytes = 0;
+    auto filling = std::async(std::launch::async, fill, std::ref(staging[0]));
+    for (size_t chunk = 0;; ++chunk) {
+        size_t nsamps = 0;
+        try {
+            nsamps = filling.get();
+        } catch (const uhd::value_error&) {
+            // Close the burst; the recording stays incomplete
+            tx_md.end_of_burst = true;
+            tx_stream->send(staging[0].data(), 0, tx_md, 0.1);
+            throw;
+        }
+        if (nsamps == 0) {
+            break;
+        }
+        const auto& buff = staging[chunk % 2];
+        filling = std::async(std::launch::async, fill, std::ref(staging[(chunk + 1) % 2]));
 
-    fmt::print(FMT_STRING("Sending {} samples to Replay block...\n"), send_buff_size_samples);
+        // Keep at most a few chunks between the host and the Replay block's memory
+        while (sent_bytes > recorded + UPLOAD_CHUNKS_IN_FLIGHT*chunk_samps*wire_itemsize) {
+            check_progress(false);
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        size_t done = 0;
+        while (done < nsamps) {
+            const size_t sent = tx_stream->send(buff.data() + 2*done, nsamps - done, tx_md, 0.1);
+            tx_md.start_of_burst = tx_md.start_of_burst && sent == 0;
+            done += sent;
+            sent_bytes += sent*wire_itemsize;
+            check_progress(sent > 0);
+        }
+    }
+    tx_md.end_of_burst = true;
+    tx_stream->send(staging[0].data(), 0, tx_md, 0.1);
 
-    size_t num_tx_samps = tx_stream->send(buffer.data(), send_buff_size_samples, tx_md, 5.0);
-    if (num_tx_samps != send_buff_size_samples) {
-        throw uhd::runtime_error(fmt::format(FMT_STRING("Failed to send all samples to Replay block. Timed out after {} of {} samples."),
-            num_tx_samps, send_buff_size_samples));
+    // Wait for the last samples to reach the Replay block's memory
+    while (recorded < replay_buff_size_bytes) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        check_progress(false);
     }
 
-    // Wait for samples to fill Replay Block's memory
-    size_t loop_timeout = 20;
-    do {
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
-        fullness = replay_ctrl->get_record_fullness();
-        if (loop_timeout == 0) {
-            throw uhd::runtime_error(fmt::format(FMT_STRING("Replay block only recorded {} of {} samples."),
-                fullness, replay_buff_size_bytes));
-        }
-        loop_timeout--;
-    } while(fullness < replay_buff_size_bytes);
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    fmt::print(FMT_STRING("Recorded {} bytes into {} in {:.3f} s ({:.1f} MB/s)\n"),
+        replay_buff_size_bytes, memory.name, elapsed.count(),
+        static_cast<double>(replay_buff_size_bytes)/elapsed.count()/1e6);
+    if (clipped > 0) {
+        fmt::print(stderr, FMT_STRING("{}: saturated {} values\n"), memory.name, clipped);
+    }
 }
 
 void rfnoc_awg::setup_clocking()
 {
+    // The first USRP takes the configured clock source and its own PPS, and passes both
+    // on; all others get theirs from it
     std::string clk_source(seq_data->settings.clock_source == clock_source_e::EXTERNAL
                                ? "external"
                                : "internal");
+    const auto first = graph->get_mb_controller(0);
     try {
-        graph->get_mb_controller(0)->set_clock_source(clk_source);
+        first->set_clock_source(clk_source);
     }
     catch (const uhd::runtime_error& e) {
         fmt::print(FMT_STRING("Clock source not supported on this device ({})\n"),
             e.what());
     }
     try {
-        graph->get_mb_controller(0)->set_time_source("internal");
+        first->set_time_source("internal");
     }
     catch (const uhd::runtime_error& e) {
         fmt::print(
             FMT_STRING("Time source not supported on this device ({})\n"), e.what());
     }
+    if (graph->get_num_mboards() < 2) {
+        return;
+    }
+    try {
+        first->set_clock_source_out(true);
+    } catch (const uhd::runtime_error& e) {
+        fmt::print(FMT_STRING("Setting clock out not supported on this device ({})\n"),
+            e.what());
+    }
+    try {
+        first->set_time_source_out(true);
+    } catch (const uhd::runtime_error& e) {
+        fmt::print(
+            FMT_STRING("Setting time out not supported on this device ({})\n"), e.what());
+    }
+    for (size_t mb = 1; mb < graph->get_num_mboards(); ++mb) {
+        graph->get_mb_controller(mb)->set_clock_source("external");
+        graph->get_mb_controller(mb)->set_time_source("external");
+    }
 }
 
 void rfnoc_awg::sync_dance()
 {
-    // Right now the RFNoC implementation only supports one USRP, so
-    // reset the timestamp to 0 on next PPS edge.
-    graph->get_mb_controller(0)->get_timekeeper(0)->set_ticks_next_pps(0);
+    // As in host mode: we don't know how close the next PPS edge is, so first wait for
+    // an edge, and then reset the time on all devices, which takes effect on the next one
+    const auto first = graph->get_mb_controller(0)->get_timekeeper(0);
+    first->set_time_next_pps(uhd::time_spec_t(666666.0));
+    auto last_pps = first->get_ticks_last_pps();
+    while (first->get_ticks_last_pps() == last_pps) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    for (size_t mb = 0; mb < graph->get_num_mboards(); ++mb) {
+        graph->get_mb_controller(mb)->get_timekeeper(0)->set_ticks_next_pps(0);
+    }
+
+    // Commands must not be timed against the old time, so wait until the reset is done
+    last_pps = first->get_ticks_last_pps();
+    while (first->get_ticks_last_pps() == last_pps) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    for (size_t mb = 1; mb < graph->get_num_mboards(); ++mb) {
+        const auto time = graph->get_mb_controller(mb)->get_timekeeper(0)->get_time_last_pps();
+        if (time != first->get_time_last_pps()) {
+            fmt::print(stderr, FMT_STRING("USRP {} is not synchronized: its last PPS was at {} s instead of {} s\n"),
+                mb, time.get_real_secs(), first->get_time_last_pps().get_real_secs());
+        }
+    }
 }
 
-void rfnoc_awg::transmit_sequences()
+replay_command_source rfnoc_awg::make_source(const replay_scheduler& scheduler, std::span<const timeline_entry> timeline, bool last, uint64_t max_passes) const
 {
-    for (const auto& [channel, seq_points] : seq_data->used_channels) {
-        const auto replay_graph = replay_graphs.at(channel);
-        const auto replay_ctrl = replay_graph.replay_ctrl;
+    // A command's length is passed on in bytes (as memory words), which must fit 64 bits
+    const auto wire_itemsize = static_cast<uint64_t>(seq_data->settings.wire_format);
+    return replay_command_source(scheduler, seq_data->program, timeline, last, UINT64_MAX / wire_itemsize, max_passes);
+}
 
-        for (size_t i = 0; i < seq_points.size(); ++i) {
-            const auto seq_point = seq_points.at(i);
-            const auto sspec = seq_data->filemap.at(seq_point.segment);
+void rfnoc_awg::issue_command(size_t channel, const replay_scheduler& scheduler, const replay_command& cmd, std::pair<uint64_t, uint64_t>& configured, bool print)
+{
+    const auto& program = seq_data->program;
+    const auto wire_itemsize = static_cast<int>(seq_data->settings.wire_format);
+    const auto& replay_graph = replay_graphs.at(channel);
+    const auto& replay_ctrl = replay_graph.replay_ctrl;
+
+    // Only reconfigure the play buffer when it changes
+    const auto& sspec = *program.segments.at(cmd.entry.segment);
+    const uint64_t replay_buff_addr = replay_graph.memory->address(sspec) + cmd.entry.sample_offset*wire_itemsize;
+    // One repetition; the Replay block wraps around in it for the command's repetitions
+    const uint64_t replay_buff_size_bytes = cmd.entry.length*wire_itemsize;
+    if (configured != std::make_pair(replay_buff_addr, replay_buff_size_bytes)) {
+        replay_ctrl->config_play(replay_buff_addr, replay_buff_size_bytes, replay_graph.replay_port);
+        configured = {replay_buff_addr, replay_buff_size_bytes};
+    }
 
-            const uint64_t replay_buff_addr = sspec.start_idx*static_cast<int>(seq_data->settings.wire_format);
-            const uint64_t replay_buff_size_samples = sspec.length;
-            const uint64_t replay_buff_size_bytes = replay_buff_size_samples*static_cast<int>(seq_data->settings.wire_format);
-            uhd::time_spec_t time_spec = uhd::time_spec_t(seq_point.start_time + START_TIME_OFFSET);
+    uhd::stream_cmd_t stream_cmd(cmd.mode);
+    if (cmd.mode != uhd::stream_cmd_t::STREAM_MODE_START_CONTINUOUS) {
+        stream_cmd.num_samps = cmd.num_samps;
+    }
+    stream_cmd.stream_now = false;
+    stream_cmd.time_spec = scheduler.time_spec(cmd);
 
-            if (seq_point.repetitions == -1) {
-                uhd::stream_cmd_t stream_cmd(uhd::stream_cmd_t::STREAM_MODE_START_CONTINUOUS);
-                stream_cmd.time_spec = time_spec;
-                stream_cmd.stream_now = false;
+    if (print) {
+        fmt::print(FMT_STRING("Chan {} -- Time: {}, Num Samples {}, Replay Addr: {}\n"), channel, stream_cmd.time_spec.get_real_secs(), cmd.num_samps, replay_buff_addr);
+    }
+    replay_ctrl->issue_stream_cmd(stream_cmd, replay_graph.replay_port);
+}
+
+void rfnoc_awg::feed_channel(size_t channel, const replay_scheduler& scheduler, replay_command_source source)
+{
+    const auto& program = seq_data->program;
+    const auto& replay_graph = replay_graphs.at(channel);
+    const auto& replay_ctrl = replay_graph.replay_ctrl;
+    const auto live = program.live.find(channel);
+    bool input_open = live != program.live.end();
+    const double poll_interval = seq_data->settings.rfnoc.poll_interval;
+    const auto pop_timeout = std::max(std::chrono::milliseconds(1),
+        std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::duration<double>(poll_interval)));
+
+    // Estimate device time from the host clock, instead of reading it for every command
+    const double device_ref = graph->get_mb_controller(replay_ctrl->get_block_id().get_device_no())->get_timekeeper(0)->get_time_now().get_real_secs();
+    const auto host_ref = std::chrono::steady_clock::now();
+    auto device_now = [&]() {
+        return device_ref + std::chrono::duration<double>(std::chrono::steady_clock::now() - host_ref).count();
+    };
 
-                fmt::print(FMT_STRING("Chan {} -- Time: {}, Num Samples {}, Replay Addr: {}\n"), channel, time_spec.get_real_secs(), replay_buff_size_samples, replay_buff_addr);
-                replay_ctrl->config_play(replay_buff_addr, replay_buff_size_bytes, replay_graph.replay_port);
-                replay_ctrl->issue_stream_cmd(stream_cmd, replay_graph.replay_port);
+    std::pair<uint64_t, uint64_t> configured{UINT64_MAX, 0};
+    // start times of the issued commands that haven't started yet, as far as we know
+    std::deque<double> pending;
+    size_t issued = 0;
+    size_t late = 0;
+    // entry from the sequence input that source is scheduling
+    timeline_entry live_entry{};
+    replay_command cmd{};
+    bool has_cmd = source.next(cmd);
+    // While more input may follow, the last command known so far isn't issued until it
+    // is nearly due, so that it can still end the stream if the input closes instead
+    auto held = [&]() {
+        return input_open && source.empty()
+            && scheduler.time_spec(cmd).get_real_secs() - device_now() > LIVE_HOLD_MARGIN;
+    };
+    while (!stop.load()) {
+        if (!has_cmd || held()) {
+            if (!input_open) {
+                break;
             }
-            else {
-                auto reps_left = seq_point.repetitions + 1;
-                replay_ctrl->config_play(replay_buff_addr, replay_buff_size_bytes, replay_graph.replay_port);
-                do {
-                    uhd::stream_cmd_t stream_cmd(uhd::stream_cmd_t::STREAM_MODE_NUM_SAMPS_AND_MORE);
-                    // Last sequence point
-                    if ((reps_left == 1) && (i == seq_points.size()-1)) {
-                        stream_cmd.stream_mode = uhd::stream_cmd_t::STREAM_MODE_NUM_SAMPS_AND_DONE;
-                    }
-                    stream_cmd.num_samps = replay_buff_size_samples;
-                    stream_cmd.stream_now = false;
-                    stream_cmd.time_spec = time_spec;
-
-                    fmt::print(FMT_STRING("Chan {} -- Time: {}, Num Samples {}, Replay Addr: {}\n"), channel, time_spec.get_real_secs(), replay_buff_size_samples, replay_buff_addr);
-                    replay_ctrl->issue_stream_cmd(stream_cmd, replay_graph.replay_port);
-
-                    double time_increment = static_cast<double>(replay_buff_size_samples)/seq_data->settings.sampling_rate;
-                    time_spec += uhd::time_spec_t(time_increment);
-
-                    reps_left--;
-                } while (reps_left > 0);
+            const auto result = live->second->pop(live_entry, pop_timeout);
+            if (result == timeline_queue::status::CLOSED) {
+                input_open = false;
+                if (has_cmd && cmd.mode == uhd::stream_cmd_t::STREAM_MODE_NUM_SAMPS_AND_MORE) {
+                    cmd.mode = uhd::stream_cmd_t::STREAM_MODE_NUM_SAMPS_AND_DONE;
+                }
+            } else if (result == timeline_queue::status::ENTRY) {
+                // The source is exhausted, so it no longer needs the previous entry
+                source = make_source(scheduler, {&live_entry, 1}, false);
+                if (!has_cmd) {
+                    has_cmd = source.next(cmd);
+                }
             }
+            continue;
+        }
+
+        // A play command leaves the command FIFO when it starts, which frees its slot
+        const double now = device_now();
+        while (!pending.empty() && pending.front() <= now) {
+            pending.pop_front();
+        }
+        size_t space = replay_ctrl->get_cmd_fifo_space(replay_graph.replay_port);
+        while (space > 0 && has_cmd && !held()) {
+            const double start = scheduler.time_spec(cmd).get_real_secs();
+            if (start < device_now() && late++ == 0) {
+                fmt::print(stderr, FMT_STRING("Chan {} -- Replay command for {} s issued late; playback has a gap\n"),
+                    channel, start);
+            }
+            issue_command(channel, scheduler, cmd, configured, issued < MAX_PRINTED_COMMANDS);
+            if (++issued == MAX_PRINTED_COMMANDS) {
+                fmt::print(FMT_STRING("Chan {} -- further commands are issued without being shown\n"), channel);
+            }
+            pending.push_back(start);
+            --space;
+            has_cmd = source.next(cmd);
+        }
+        if (has_cmd && space == 0) {
+            // The FIFO is full: wait for the next command to start, but keep checking
+            const double wait = pending.empty() ? poll_interval : pending.front() - now;
+            std::this_thread::sleep_for(std::chrono::duration<double>(
+                std::clamp(wait, MIN_POLL_INTERVAL, poll_interval)));
         }
     }
+    fmt::print(FMT_STRING("Chan {} -- issued {} Replay commands, {} late\n"), channel, issued, late);
+}
+
+void rfnoc_awg::transmit_sequences()
+{
+    const auto& program = seq_data->program;
+
+    // Schedule (and verify) all channels before issuing anything
+    std::map<size_t, replay_scheduler> schedulers;
+    size_t violations = 0;
+    for (const auto& [channel, timeline] : program.channels) {
+        const auto& replay_graph = replay_graphs.at(channel);
+        const double play_rate = replay_graph.duc_ctrl ? replay_graph.duc_ctrl->get_input_rate(replay_graph.duc_port) : replay_graph.radio_ctrl->get_rate();
+        const auto& scheduler = schedulers.try_emplace(channel, play_rate, replay_graph.radio_ctrl->get_rate(), START_TIME_OFFSET).first->second;
+        if (!scheduler.exact()) {
+            fmt::print(stderr, FMT_STRING("Channel {}: radio rate {} is not a multiple of the sampling rate {}; sample boundaries don't fall on radio ticks\n"),
+                channel, replay_graph.radio_ctrl->get_rate(), play_rate);
+        }
+        if (seq_data->settings.rfnoc.verify_schedule) {
+            violations += scheduler.verify(channel,
+                make_source(scheduler, timeline, !program.live.contains(channel), replay_scheduler::VERIFIED_PASSES));
+        }
+    }
+    if (violations > 0) {
+        throw uhd::runtime_error(fmt::format(FMT_STRING("Replay command schedule has {} violations"), violations));
+    }
+
+    // Each channel's feeder keeps its command FIFO filled, from the program and then
+    // from the sequence input
+    std::vector<std::thread> feeders;
+    for (const auto& [channel, timeline] : program.channels) {
+        const auto& scheduler = schedulers.at(channel);
+        // A channel fed by the sequence input doesn't end with its initial timeline
+        auto source = make_source(scheduler, timeline, !program.live.contains(channel));
+        feeders.emplace_back([this, channel, &scheduler, source]() {
+            try {
+                feed_channel(channel, scheduler, source);
+            } catch (const std::exception& err) {
+                fmt::print(stderr, FMT_STRING("Chan {} -- {}\n"), channel, err.what());
+            }
+        });
+    }
 
     fmt::print("Transmitting sequences (Press Ctrl+C to stop)...\n");
     while (!stop.load()) {
         std::this_thread::sleep_for(std::chrono::milliseconds(100));
     }
     fmt::print("Stopping...\n");
-    for (const auto& [channel, seq_points] : seq_data->used_channels) {
+    for (auto& feeder : feeders) {
+        feeder.join();
+    }
+    for (const auto& [channel, timeline] : seq_data->program.channels) {
         const auto replay_graph = replay_graphs.at(channel);
         const auto replay_ctrl = replay_graph.replay_ctrl;
 
@@ -0,0 +1,183 @@
+/*
+ * Copyright 2023 Ettus Research, A National Instruments Brand
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+#include "multichannel_awg/segment_reader.hpp"
+#include "multichannel_awg/convert.hpp"
+#include <fmt/format.h>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <string>
+#include <system_error>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+// Alignment suitable for O_DIRECT on all common block devices
+constexpr size_t block_alignment = 4096;
+// Alignment of the sc16 copies of blocks, for SIMD stores
+constexpr size_t converted_alignment = 64;
+} // namespace
+
+segment_reader::segment_reader(const segment_spec& sspec,
+    uint64_t plays,
+    const loading_settings& settings,
+    size_t itemsize,
+    const preconvert_settings& preconvert)
+    : filename(sspec.filename)
+    , itemsize(itemsize)
+    , preconvert(preconvert)
+{
+    // Aligned blocks, so that O_DIRECT reads are possible; as sample sizes divide the
+    // alignment, blocks also hold whole samples
+    block_size = std::max(settings.stream_block_size / block_alignment, size_t(1))
+                 * block_alignment;
+    file_size    = sspec.length * itemsize;
+    file_blocks  = (file_size + block_size - 1) / block_size;
+    total_blocks = (file_blocks == 0) ? 0
+                   : (plays == FOREVER) ? FOREVER
+                                        : file_blocks * plays;
+
+    int flags = O_RDONLY | O_CLOEXEC;
+#ifdef O_DIRECT
+    if (settings.direct_io) {
+        flags |= O_DIRECT;
+    }
+#endif
+    fd = ::open(filename.c_str(), flags);
+    if (fd < 0) {
+        throw std::system_error(errno, std::generic_category(), "open " + filename);
+    }
+#ifdef POSIX_FADV_SEQUENTIAL
+    ::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    slots.resize(std::max(settings.stream_blocks, size_t(2)));
+    for (auto& s : slots) {
+        s.data = static_cast<char*>(std::aligned_alloc(block_alignment, block_size));
+        if (s.data && preconvert.enabled) {
+            // half of the aligned block size is still a multiple of the SIMD alignment
+            s.converted =
+                static_cast<int16_t*>(std::aligned_alloc(converted_alignment, block_size / 2));
+        }
+        if (!s.data || (preconvert.enabled && !s.converted)) {
+            // The destructor doesn't run for a constructor that throws
+            for (auto& allocated : slots) {
+                std::free(allocated.data);
+                std::free(allocated.converted);
+            }
+            ::close(fd);
+            throw std::bad_alloc();
+        }
+    }
+    for (size_t idx = 0; idx < std::max(settings.stream_readers, size_t(1)); ++idx) {
+        workers.emplace_back(&segment_reader::work, this);
+    }
+}
+
+segment_reader::~segment_reader()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        shutdown = true;
+    }
+    slot_free.notify_all();
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    for (auto& s : slots) {
+        std::free(s.data);
+        std::free(s.converted);
+    }
+    if (fd >= 0) {
+        ::close(fd);
+    }
+}
+
+void segment_reader::work()
+{
+    while (true) {
+        uint64_t index;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            slot_free.wait(lock, [this]() {
+                return shutdown
+                       || (next_to_issue < total_blocks
+                           && next_to_issue < next_to_consume + slots.size());
+            });
+            if (shutdown) {
+                return;
+            }
+            index = next_to_issue++;
+        }
+
+        slot& s             = slots[index % slots.size()];
+        const size_t offset = (index % file_blocks) * block_size;
+        const size_t wanted = std::min(block_size, file_size - offset);
+        size_t got          = 0;
+        while (got < wanted) {
+            // O_DIRECT wants whole aligned blocks, even past the end of the file
+            const ssize_t result =
+                ::pread(fd, s.data + got, block_size - got, static_cast<off_t>(offset + got));
+            if (result < 0 && errno == EINTR) {
+                continue;
+            }
+            if (result <= 0) {
+                fmt::print(stderr,
+                    FMT_STRING("Reading '{}' at offset {} failed: {}\n"),
+                    filename,
+                    offset + got,
+                    result < 0 ? std::generic_category().message(errno)
+                               : std::string("unexpected end of file"));
+                // Don't stall playback: send silence instead
+                std::fill(s.data + got, s.data + wanted, 0);
+                break;
+            }
+            got += static_cast<size_t>(result);
+        }
+        s.length = wanted / itemsize;
+        if (preconvert.enabled) {
+            convert_fc32_to_sc16(reinterpret_cast<const float*>(s.data),
+                s.converted,
+                s.length,
+                preconvert.scale);
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            s.ready_index = index;
+        }
+        slot_ready.notify_all();
+    }
+}
+
+bool segment_reader::next(block& blk, const std::atomic<bool>& stop)
+{
+    using namespace std::chrono_literals;
+    std::unique_lock<std::mutex> lock(mutex);
+    if (next_to_consume >= total_blocks) {
+        return false;
+    }
+    slot& s = slots[next_to_consume % slots.size()];
+    while (s.ready_index != next_to_consume) {
+        if (stop.load()) {
+            return false;
+        }
+        slot_ready.wait_for(lock, 100ms);
+    }
+    blk = {s.converted ? reinterpret_cast<const char*>(s.converted) : s.data, s.length};
+    return true;
+}
+
+void segment_reader::release()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        ++next_to_consume;
+    }
+    slot_free.notify_one();
+}
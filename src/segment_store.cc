@@ -0,0 +1,506 @@
+/*
+ * Copyright 2023 Ettus Research, A National Instruments Brand
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+#include "multichannel_awg/segment_store.hpp"
+#include "multichannel_awg/convert.hpp"
+#include <uhd/exception.hpp>
+#include <fmt/format.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Four independent lanes, so it runs at memory speed
+uint64_t content_hash(const char* data, size_t size)
+{
+    constexpr uint64_t prime = 0x9e3779b97f4a7c15ULL;
+    uint64_t lanes[4]        = {size, size ^ prime, ~size, size * prime};
+    size_t idx               = 0;
+    for (; idx + 32 <= size; idx += 32) {
+        for (size_t lane = 0; lane < 4; ++lane) {
+            uint64_t word;
+            std::memcpy(&word, data + idx + 8 * lane, sizeof(word));
+            lanes[lane] = (lanes[lane] ^ word) * prime;
+            lanes[lane] ^= lanes[lane] >> 29;
+        }
+    }
+    uint64_t hash = lanes[0] ^ (lanes[1] << 1) ^ (lanes[2] << 2) ^ (lanes[3] << 3);
+    for (; idx < size; ++idx) {
+        hash = (hash ^ static_cast<unsigned char>(data[idx])) * prime;
+    }
+    return hash ^ (hash >> 32);
+}
+
+namespace {
+//! bytes from each end of a file that candidates for deduplication are screened by
+constexpr size_t screen_bytes = 64 * 1024;
+
+//! \brief Runs job(idx) for idx in [0, count) on up to num_threads threads
+void parallel_for(size_t count, size_t num_threads, const std::function<void(size_t)>& job)
+{
+    std::atomic<size_t> next{0};
+    std::exception_ptr failure;
+    std::mutex failure_mutex;
+    auto worker = [&]() {
+        for (size_t idx = next++; idx < count; idx = next++) {
+            try {
+                job(idx);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(failure_mutex);
+                if (!failure) {
+                    failure = std::current_exception();
+                }
+                return;
+            }
+        }
+    };
+    std::vector<std::thread> workers;
+    for (size_t idx = 0; idx < std::min(count, num_threads); ++idx) {
+        workers.emplace_back(worker);
+    }
+    for (auto& thread : workers) {
+        thread.join();
+    }
+    if (failure) {
+        std::rethrow_exception(failure);
+    }
+}
+
+//! \brief hash of the first and last screen_bytes of the size bytes of a file
+uint64_t screen_hash(const std::string& filename, size_t size)
+{
+    std::vector<char> ends(std::min(size, 2 * screen_bytes));
+    std::ifstream file(filename, std::ios::binary);
+    const size_t head = std::min(size, screen_bytes);
+    file.read(ends.data(), static_cast<std::streamsize>(head));
+    file.seekg(static_cast<std::streamoff>(size - (ends.size() - head)));
+    file.read(ends.data() + head, static_cast<std::streamsize>(ends.size() - head));
+    if (!file) {
+        throw std::runtime_error(fmt::format(FMT_STRING("Short read from '{}'"), filename));
+    }
+    return content_hash(ends.data(), ends.size());
+}
+} // namespace
+
+void segment_store::deduplicate(sequencer_data::filemap_t& filemap, size_t num_threads)
+{
+    // Candidates in name order, so the choice of the segment that is kept is stable
+    std::vector<segment_spec*> files;
+    for (auto& [id, seg] : filemap) {
+        if (seg.referenced && !seg.streamed && !seg.derived) {
+            files.push_back(&seg);
+        }
+    }
+    std::sort(files.begin(), files.end(), [](const auto* lhs, const auto* rhs) {
+        return lhs->name < rhs->name;
+    });
+
+    auto share = [](segment_spec& duplicate, const segment_spec& original) {
+        fmt::print(FMT_STRING("Segment '{}' is identical to '{}'; sharing its samples\n"),
+            duplicate.name,
+            original.name);
+        duplicate.derived = segment_derivation{.base = original.name};
+    };
+
+    // Same file under another name; then same contents, which can only be the case
+    // for files of the same size
+    std::map<std::filesystem::path, segment_spec*> by_path;
+    std::map<size_t, std::vector<segment_spec*>> by_size;
+    for (auto* seg : files) {
+        const auto path = std::filesystem::weakly_canonical(seg->filename);
+        if (const auto [original, inserted] = by_path.emplace(path, seg); !inserted) {
+            share(*seg, *original->second);
+        } else {
+            by_size[seg->length * seg->itemsize].push_back(seg);
+        }
+    }
+    auto size_of = [](const segment_spec* seg) { return seg->length * seg->itemsize; };
+
+    std::vector<segment_spec*> candidates;
+    for (auto& [size, group] : by_size) {
+        if (group.size() > 1 && size > 0) {
+            candidates.insert(candidates.end(), group.begin(), group.end());
+        }
+    }
+    if (candidates.empty()) {
+        return;
+    }
+
+    // Screen by both ends of each file first, in parallel, so that a library of
+    // equally long waveforms isn't read as a whole; only files that pass are hashed
+    // completely, one mapping at a time per thread
+    std::vector<uint64_t> hashes(candidates.size());
+    parallel_for(candidates.size(), num_threads, [&](size_t idx) {
+        hashes[idx] = screen_hash(candidates[idx]->filename, size_of(candidates[idx]));
+    });
+    // screen hashes of files no longer than the screen are already complete hashes
+    std::unordered_map<const segment_spec*, uint64_t> complete;
+    {
+        // only files whose size and screen hash match another's remain, in name order
+        std::map<std::pair<size_t, uint64_t>, std::vector<segment_spec*>> screened;
+        for (size_t idx = 0; idx < candidates.size(); ++idx) {
+            screened[{size_of(candidates[idx]), hashes[idx]}].push_back(candidates[idx]);
+            if (size_of(candidates[idx]) <= 2 * screen_bytes) {
+                complete.emplace(candidates[idx], hashes[idx]);
+            }
+        }
+        candidates.clear();
+        for (const auto& [key, group] : screened) {
+            if (group.size() > 1) {
+                candidates.insert(candidates.end(), group.begin(), group.end());
+            }
+        }
+        std::sort(candidates.begin(), candidates.end(), [](const auto* lhs, const auto* rhs) {
+            return lhs->name < rhs->name;
+        });
+    }
+    hashes.assign(candidates.size(), 0);
+    parallel_for(candidates.size(), num_threads, [&](size_t idx) {
+        const auto* seg = candidates[idx];
+        if (const auto known = complete.find(seg); known != complete.end()) {
+            hashes[idx] = known->second;
+            return;
+        }
+        const mapped_file content(seg->filename, prefault_e::WILLNEED, false, true);
+        hashes[idx] = content_hash(content.data(), size_of(seg));
+    });
+
+    // A matching hash is confirmed byte by byte against the files kept so far
+    std::map<std::pair<size_t, uint64_t>, std::vector<segment_spec*>> kept;
+    for (size_t idx = 0; idx < candidates.size(); ++idx) {
+        auto* seg        = candidates[idx];
+        const size_t size = size_of(seg);
+        auto& originals  = kept[{size, hashes[idx]}];
+        bool shared      = false;
+        if (!originals.empty()) {
+            const mapped_file content(seg->filename, prefault_e::WILLNEED, false, true);
+            for (const auto* original : originals) {
+                const mapped_file other(original->filename, prefault_e::WILLNEED, false, true);
+                if (std::memcmp(other.data(), content.data(), size) == 0) {
+                    share(*seg, *original);
+                    shared = true;
+                    break;
+                }
+            }
+        }
+        if (!shared) {
+            originals.push_back(seg);
+        }
+    }
+}
+
+void segment_store::load(
+    sequencer_data::filemap_t& filemap, const loading_settings& settings)
+{
+    size_t unreferenced = 0;
+    for (const auto& [id, seg] : filemap) {
+        unreferenced += seg.referenced ? 0 : 1;
+    }
+    if (unreferenced > 0) {
+        fmt::print(FMT_STRING("Skipping {} segments that aren't played\n"), unreferenced);
+    }
+    const size_t num_readers = settings.load_threads
+                                        ? settings.load_threads
+                                        : std::max(std::thread::hardware_concurrency(), 1u);
+    deduplicate(filemap, num_readers);
+
+    // Place segments in a fixed order, so the layout doesn't depend on hashing
+    std::vector<segment_spec*> placed;
+    for (auto& [id, seg] : filemap) {
+        if (seg.referenced && !seg.streamed && !seg.is_view()) {
+            placed.push_back(&seg);
+        }
+    }
+    std::sort(placed.begin(), placed.end(), [](const auto* lhs, const auto* rhs) {
+        return lhs->name < rhs->name;
+    });
+
+    total_size = 0;
+    size_t derived_size = 0;
+    std::vector<segment_spec*> segments; // those read from files
+    for (auto* seg : placed) {
+        seg->start_idx = total_size;
+        total_size += seg->length * seg->itemsize;
+        if (seg->derived) {
+            derived_size += seg->length * seg->itemsize;
+        } else {
+            segments.push_back(seg);
+        }
+    }
+    std::unordered_map<const segment_spec*, char*> targets;
+    if (settings.mmap) {
+        mappings.resize(segments.size());
+        derived.resize(derived_size);
+        size_t offset = 0;
+        for (auto* seg : placed) {
+            if (seg->derived) {
+                targets[seg] = derived.data() + offset;
+                offset += seg->length * seg->itemsize;
+            }
+        }
+    } else {
+        buffer.resize(total_size);
+        for (auto* seg : placed) {
+            if (seg->derived) {
+                targets[seg] = buffer.data() + seg->start_idx;
+            }
+        }
+    }
+    load_stats.resize(segments.size());
+
+    const size_t num_threads = std::min<size_t>(segments.size(), num_readers);
+    std::atomic<size_t> next_segment{0};
+    std::exception_ptr failure;
+    std::mutex failure_mutex;
+
+    auto worker = [&]() {
+        for (size_t idx = next_segment++; idx < segments.size(); idx = next_segment++) {
+            segment_spec& seg         = *segments[idx];
+            const size_t length_bytes = seg.length * seg.itemsize;
+            const auto start          = std::chrono::steady_clock::now();
+            try {
+                if (settings.mmap) {
+                    mappings[idx] =
+                        mapped_file(seg.filename, settings.prefault, settings.mlock);
+                    seg.data = mappings[idx].data();
+                } else {
+                    std::ifstream input_file(seg.filename, std::ios::binary);
+                    input_file.read(buffer.data() + seg.start_idx,
+                        static_cast<std::streamsize>(length_bytes));
+                    if (static_cast<size_t>(input_file.gcount()) != length_bytes) {
+                        throw std::runtime_error(fmt::format(
+                            FMT_STRING("Short read from '{}' for segment '{}'"),
+                            seg.filename,
+                            seg.name));
+                    }
+                    seg.data = buffer.data() + seg.start_idx;
+                }
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(failure_mutex);
+                if (!failure) {
+                    failure = std::current_exception();
+                }
+                return;
+            }
+            const std::chrono::duration<double> elapsed =
+                std::chrono::steady_clock::now() - start;
+            load_stats[idx] = {seg.name, seg.filename, length_bytes, elapsed.count()};
+        }
+    };
+
+    const auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> workers;
+    for (size_t idx = 0; idx < num_threads; ++idx) {
+        workers.emplace_back(worker);
+    }
+    for (auto& thread : workers) {
+        thread.join();
+    }
+    if (failure) {
+        std::rethrow_exception(failure);
+    }
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    for (size_t idx = 0; idx < segments.size(); ++idx) {
+        const auto& stats = load_stats[idx];
+        fmt::print(FMT_STRING("{} {:L} B of data from file '{}' for segment '{}' in "
+                              "{:.3f} s ({:.1f} MB/s){}\n"),
+            settings.mmap ? "Mapped" : "Read",
+            stats.bytes,
+            stats.filename,
+            stats.segment,
+            stats.seconds,
+            stats.seconds > 0 ? stats.bytes / stats.seconds / 1e6 : 0.0,
+            settings.mmap && mappings[idx].locked() ? " (locked)" : "");
+    }
+    const size_t loaded_size = total_size - derived_size;
+    fmt::print(FMT_STRING("Loaded {:L} B in {} segments using {} threads in {:.3f} s "
+                          "({:.1f} MB/s)\n"),
+        loaded_size,
+        segments.size(),
+        num_threads,
+        elapsed.count(),
+        elapsed.count() > 0 ? loaded_size / elapsed.count() / 1e6 : 0.0);
+
+    derive(filemap, targets);
+}
+
+void segment_store::derive(sequencer_data::filemap_t& filemap,
+    const std::unordered_map<const segment_spec*, char*>& targets)
+{
+    if (targets.empty()) {
+        point_views(filemap);
+        return;
+    }
+    const auto start = std::chrono::steady_clock::now();
+    for (auto& [id, seg] : filemap) {
+        if (const auto target = targets.find(&seg); target != targets.end()) {
+            seg.data = target->second;
+        }
+    }
+    point_views(filemap);
+
+    // A segment may derive from another derived one, which then has to be computed first
+    size_t total_samples = 0;
+    std::set<const segment_spec*> done;
+    std::function<void(const segment_spec&)> compute = [&](const segment_spec& seg) {
+        if (!seg.derived || !seg.referenced || !done.insert(&seg).second) {
+            return;
+        }
+        const auto& derivation = *seg.derived;
+        const auto& base       = filemap.at(derivation.base);
+        compute(base);
+        if (seg.is_view()) {
+            return;
+        }
+        const char* in = base.data + derivation.offset * base.itemsize;
+        char* out      = targets.at(&seg);
+        if (seg.itemsize == static_cast<size_t>(dataformat_e::FC_32)) {
+            mix_fc32(reinterpret_cast<const float*>(in),
+                reinterpret_cast<float*>(out),
+                seg.length,
+                derivation.gain,
+                derivation.frequency,
+                derivation.phase);
+        } else {
+            const size_t clipped = mix_sc16(reinterpret_cast<const int16_t*>(in),
+                reinterpret_cast<int16_t*>(out),
+                seg.length,
+                derivation.gain,
+                derivation.frequency,
+                derivation.phase);
+            if (clipped > 0) {
+                fmt::print(stderr,
+                    FMT_STRING("Segment '{}': saturated {} values\n"),
+                    seg.name,
+                    clipped);
+            }
+        }
+        total_samples += seg.length;
+    };
+    for (const auto& [id, seg] : filemap) {
+        compute(seg);
+    }
+
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    fmt::print(FMT_STRING("Derived {:L} samples in {} segments in {:.3f} s\n"),
+        total_samples,
+        targets.size(),
+        elapsed.count());
+}
+
+void segment_store::point_views(sequencer_data::filemap_t& filemap)
+{
+    // Slices of slices: the base has to be pointed first
+    std::set<const segment_spec*> done;
+    std::function<void(segment_spec&)> point = [&](segment_spec& seg) {
+        if (!seg.is_view() || !seg.referenced || !done.insert(&seg).second) {
+            return;
+        }
+        auto& base = filemap.at(seg.derived->base);
+        point(base);
+        seg.itemsize  = base.itemsize;
+        seg.data      = base.data + seg.derived->offset * base.itemsize;
+        seg.start_idx = base.start_idx + seg.derived->offset * base.itemsize;
+    };
+    for (auto& [id, seg] : filemap) {
+        point(seg);
+    }
+}
+
+void segment_store::convert_to_sc16(
+    sequencer_data::filemap_t& filemap, const preconvert_settings& settings)
+{
+    const auto start               = std::chrono::steady_clock::now();
+    constexpr size_t fc32_itemsize = static_cast<size_t>(dataformat_e::FC_32);
+    constexpr size_t sc16_itemsize = static_cast<size_t>(dataformat_e::SC_16);
+
+    // Streamed segments are converted while playing, when a clipping sample can't fail
+    // loading any more
+    if (!settings.saturate) {
+        for (const auto& [id, seg] : filemap) {
+            if (seg.referenced && seg.streamed && seg.itemsize == fc32_itemsize) {
+                throw uhd::value_error(fmt::format(
+                    FMT_STRING("Segment '{}' is streamed from disk, so it can't be checked "
+                               "for clipping; set \"saturate\": true to play it"),
+                    seg.name));
+            }
+        }
+    }
+
+    std::vector<char> converted(total_size / fc32_itemsize * sc16_itemsize);
+    size_t total_samples = 0;
+    for (auto& [id, seg] : filemap) {
+        // streamed segments are converted block by block by their segment_reader; slices
+        // follow their base
+        if (!seg.referenced || seg.streamed || seg.is_view()
+            || seg.itemsize != fc32_itemsize) {
+            continue;
+        }
+        seg.start_idx = seg.start_idx / fc32_itemsize * sc16_itemsize;
+        char* out     = converted.data() + seg.start_idx;
+        const size_t clipped =
+            convert_fc32_to_sc16(reinterpret_cast<const float*>(seg.data),
+                reinterpret_cast<int16_t*>(out),
+                seg.length,
+                settings.scale);
+        if (clipped > 0) {
+            if (!settings.saturate) {
+                throw uhd::value_error(fmt::format(
+                    FMT_STRING("Segment '{}': {} values out of range at scale {}"),
+                    seg.name,
+                    clipped,
+                    settings.scale));
+            }
+            fmt::print(stderr,
+                FMT_STRING("Segment '{}': saturated {} values\n"),
+                seg.name,
+                clipped);
+        }
+        seg.data     = out;
+        seg.itemsize = sc16_itemsize;
+        total_samples += seg.length;
+    }
+    // The converted copy replaces the original data, read or mapped
+    buffer = std::move(converted);
+    mappings.clear();
+    derived.clear();
+    total_size = buffer.size();
+    point_views(filemap);
+
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    fmt::print(FMT_STRING("Converted {:L} samples to sc16 in {:.3f} s\n"),
+        total_samples,
+        elapsed.count());
+}
+
+void segment_store::release(sequencer_data::filemap_t& filemap)
+{
+    for (auto& [id, seg] : filemap) {
+        if (!seg.streamed) {
+            seg.data = nullptr;
+        }
+    }
+    // clear() alone keeps the capacity
+    std::vector<char>().swap(buffer);
+    std::vector<char>().swap(derived);
+    mappings.clear();
+    total_size = 0;
+}
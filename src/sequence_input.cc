@@ -0,0 +1,183 @@
+/*
+ * Copyright 2023 Ettus Research, A National Instruments Brand
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+#include "multichannel_awg/sequence_input.hpp"
+#include "multichannel_awg/sequence.hpp"
+#include "multichannel_awg/timeline.hpp"
+#include <nlohmann/json.hpp>
+#include <fmt/format.h>
+#include <poll.h>
+#include <unistd.h>
+#include <cerrno>
+#include <memory>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+
+sequence_input::sequence_input(int fd, const std::atomic<bool>& stop) : fd(fd), stop(stop)
+{
+    std::string line;
+    while (line.find_first_not_of(" \t\r") == std::string::npos) {
+        if (!read_line(line)) {
+            throw std::runtime_error("Sequence input ended before its header");
+        }
+    }
+    header_json = nlohmann::json::parse(line);
+}
+
+void sequence_input::attach(sequencer_data& data)
+{
+    std::set<size_t> channels;
+    for (const auto& [channel, sp_vec] : data.used_channels) {
+        channels.insert(channel);
+    }
+    for (size_t channel : header_json.value("channels", std::vector<size_t>{})) {
+        channels.insert(channel);
+    }
+    if (channels.empty()) {
+        throw std::runtime_error(
+            "Sequence input header has neither \"channels\" nor a \"sequence\"");
+    }
+
+    auto& program = data.program;
+    for (auto channel : channels) {
+        program.channels.try_emplace(channel);
+        queues[channel] = std::make_shared<timeline_queue>(data.settings.live.queue_size);
+    }
+    program.live = queues;
+    builder      = std::make_unique<timeline_builder>(program);
+    // any segment may be played now
+    data.mark_referenced();
+}
+
+void sequence_input::run()
+{
+    size_t received = 0;
+    std::string line;
+    while (read_line(line)) {
+        if (line.find_first_not_of(" \t\r") == std::string::npos) {
+            continue;
+        }
+        ++received;
+        sequence_point sp;
+        try {
+            const auto point = nlohmann::json::parse(line);
+            if (point.contains("loop") || point.contains("pattern")) {
+                ++report.invalid;
+                report.add_message(fmt::format(
+                    FMT_STRING("Sequence input point {}: loops are not supported in "
+                               "streaming input; skipping it."),
+                    received));
+                continue;
+            }
+            sp = point.get<sequence_point>();
+        } catch (const nlohmann::json::exception& err) {
+            ++report.invalid;
+            report.add_message(
+                fmt::format(FMT_STRING("Sequence input point {}: {}"), received, err.what()));
+            continue;
+        }
+        const auto queue = queues.find(sp.channel);
+        if (queue == queues.end()) {
+            ++report.invalid;
+            report.add_message(fmt::format(
+                FMT_STRING("Sequence input point {}: channel {} wasn't announced in the "
+                           "header; skipping it."),
+                received,
+                sp.channel));
+            continue;
+        }
+
+        timeline_entry entry;
+        switch (builder->add(sp, entry)) {
+            case timeline_builder::status::DELAYED:
+                ++report.adjusted;
+                report.add_message(fmt::format(
+                    FMT_STRING("Channel {}: start time {} is before the end of the "
+                               "previous segment; adjusting."),
+                    sp.channel,
+                    sp.start_time));
+                break;
+            case timeline_builder::status::UNKNOWN_SEGMENT:
+                ++report.unknown_segment;
+                report.add_message(fmt::format(
+                    FMT_STRING("Channel {}: segment '{}' at {} s is not defined; "
+                               "skipping it."),
+                    sp.channel,
+                    sp.segment,
+                    sp.start_time));
+                continue;
+            case timeline_builder::status::UNREACHABLE:
+                ++report.unreachable;
+                continue;
+            case timeline_builder::status::EMPTY_SEGMENT:
+                continue;
+            case timeline_builder::status::ADDED:
+                break;
+        }
+        // Blocks while the channel's queue is full
+        if (!queue->second->push(entry, stop)) {
+            break;
+        }
+    }
+
+    for (auto& [channel, queue] : queues) {
+        queue->close();
+    }
+    report.print();
+    fmt::print(FMT_STRING("Sequence input ended after {} points\n"), received);
+}
+
+bool sequence_input::read_line(std::string& line)
+{
+    while (true) {
+        const auto newline = buffer.find('\n', read_pos);
+        if (newline != std::string::npos) {
+            line.assign(buffer, read_pos, newline - read_pos);
+            read_pos = newline + 1;
+            return true;
+        }
+        if (end_of_input) {
+            if (read_pos == buffer.size()) {
+                return false;
+            }
+            // last line without a newline
+            line.assign(buffer, read_pos);
+            read_pos = buffer.size();
+            return true;
+        }
+        if (stop.load()) {
+            return false;
+        }
+        // only keep the unread part
+        buffer.erase(0, read_pos);
+        read_pos = 0;
+
+        // Wait in short steps, so a stop request isn't missed while nothing arrives
+        pollfd pfd{fd, POLLIN, 0};
+        const int ready = ::poll(&pfd, 1, 100);
+        if (ready < 0 && errno != EINTR) {
+            throw std::system_error(errno, std::generic_category(), "poll");
+        }
+        if (ready <= 0) {
+            continue;
+        }
+        char chunk[1 << 16];
+        const ssize_t count = ::read(fd, chunk, sizeof(chunk));
+        if (count < 0) {
+            if (errno == EINTR || errno == EAGAIN) {
+                continue;
+            }
+            throw std::system_error(errno, std::generic_category(), "read");
+        }
+        if (count == 0) {
+            end_of_input = true;
+        } else {
+            buffer.append(chunk, static_cast<size_t>(count));
+        }
+    }
+}
@@ -8,18 +8,255 @@
 #include "multichannel_awg/sequence.hpp"
 #include <nlohmann/json.hpp>
 #include <fmt/format.h>
+#include <fmt/ranges.h>
+#include <algorithm>
+#include <chrono>
 #include <filesystem>
+#include <future>
+#include <map>
+#include <memory>
+#include <set>
+#include <span>
 #include <stdexcept>
 #include <string>
 #include <vector>
 #include <unordered_map>
+#include <utility>
 
 using json = nlohmann::json;
 
+namespace {
+/*!
+ * Parses loop bodies. A named pattern is parsed once, on first use, and shared by all
+ * loops that play it.
+ */
+class body_parser
+{
+public:
+    explicit body_parser(const json& patterns) : patterns(patterns) {}
+
+    //! \brief sets sp.body from item's "loop" or "pattern", if it has either
+    void parse_loop(const json& item, sequence_point& sp)
+    {
+        if (item.contains("loop")) {
+            sp.body = parse_body(item.at("loop"));
+        } else if (item.contains("pattern")) {
+            sp.body = pattern(item.at("pattern").get<std::string>());
+        }
+    }
+
+private:
+    std::shared_ptr<const sequence_body> parse_body(const json& items)
+    {
+        auto body = std::make_shared<sequence_body>();
+        for (const auto& item : items) {
+            sequence_point sp{.channel = 0,
+                .start_time            = 0.0,
+                .repetitions           = item.value("repetitions", 0),
+                .segment               = item.value("segment", std::string{}),
+                .body                  = nullptr,
+                .gap                   = item.value("gap", 0.0)};
+            parse_loop(item, sp);
+            if (sp.segment.empty() && !sp.body) {
+                throw std::invalid_argument(
+                    "loop items need a \"segment\", \"loop\" or \"pattern\"");
+            }
+            body->push_back(std::move(sp));
+        }
+        return body;
+    }
+
+    std::shared_ptr<const sequence_body> pattern(const std::string& name)
+    {
+        if (const auto known = parsed.find(name); known != parsed.end()) {
+            return known->second;
+        }
+        if (!patterns.contains(name)) {
+            throw std::invalid_argument("pattern '" + name + "' is not defined");
+        }
+        if (!in_progress.insert(name).second) {
+            throw std::invalid_argument("pattern '" + name + "' contains itself");
+        }
+        auto body = parse_body(patterns.at(name));
+        in_progress.erase(name);
+        return parsed[name] = body;
+    }
+
+    const json& patterns;
+    std::unordered_map<std::string, std::shared_ptr<const sequence_body>> parsed;
+    std::set<std::string> in_progress;
+};
+
+//! Checks loop bodies and computes how long they take; each body only once
+class body_checker
+{
+public:
+    body_checker(const sequencer_data::filemap_t& filemap,
+        double sampling_rate,
+        size_t channel,
+        validation_report& report)
+        : filemap(filemap), sampling_rate(sampling_rate), channel(channel), report(report)
+    {
+    }
+
+    //! \brief seconds one pass through body takes
+    double duration(const sequence_body& body)
+    {
+        if (const auto known = durations.find(&body); known != durations.end()) {
+            return known->second;
+        }
+        double total = 0.0;
+        path.push_back(0);
+        for (const auto& item : body) {
+            if (item.repetitions < 0) {
+                ++report.invalid;
+                report.add_message(fmt::format(
+                    FMT_STRING("Channel {}: endless repetition of '{}' {} is played once."),
+                    channel,
+                    item.body ? "loop" : item.segment,
+                    position()));
+            }
+            total += item.gap + std::max(item.repetitions, 1) * duration(item);
+            ++path.back();
+        }
+        path.pop_back();
+        return durations[&body] = total;
+    }
+
+    //! \brief seconds one repetition of item takes
+    double duration(const sequence_point& item)
+    {
+        if (path.empty()) {
+            loop_start = item.start_time;
+        }
+        if (item.body) {
+            return duration(*item.body);
+        }
+        const auto segment = filemap.find(item.segment);
+        if (segment == filemap.end()) {
+            ++report.unknown_segment;
+            report.add_message(fmt::format(
+                FMT_STRING("Channel {}: segment '{}' {} is not defined; skipping it."),
+                channel,
+                item.segment,
+                position()));
+            return 0.0;
+        }
+        return segment->second.length / sampling_rate;
+    }
+
+private:
+    const sequencer_data::filemap_t& filemap;
+    const double sampling_rate;
+    const size_t channel;
+    validation_report& report;
+    std::unordered_map<const sequence_body*, double> durations;
+    //! start time of the top-level item being checked; items in a body start at 0
+    double loop_start = 0.0;
+    //! index of the item being checked in each enclosing body, outermost first
+    std::vector<size_t> path;
+
+    //! \brief where the item being checked is, for messages
+    std::string position() const
+    {
+        if (path.empty()) {
+            return fmt::format(FMT_STRING("at {} s"), loop_start);
+        }
+        return fmt::format(
+            FMT_STRING("at item {} of the loop at {} s"), fmt::join(path, "."), loop_start);
+    }
+};
+
+/*!
+ * Sets the length of a derived segment (to the requested one in lengths, or the rest of
+ * its base) and of the segments it derives from. Checks that its base exists, can be
+ * derived from, and is long enough.
+ */
+size_t resolve_derived(sequencer_data::filemap_t& filemap,
+    segment_spec& seg,
+    const std::map<std::string, size_t>& lengths,
+    std::set<std::string>& in_progress)
+{
+    if (!seg.derived || seg.length != static_cast<size_t>(-1)) {
+        return seg.length;
+    }
+    const auto& derivation = *seg.derived;
+    const auto base        = filemap.find(derivation.base);
+    if (base == filemap.end()) {
+        throw std::invalid_argument(fmt::format(
+            FMT_STRING("Segment '{}': base segment '{}' is not defined"),
+            seg.name,
+            derivation.base));
+    }
+    if (base->second.streamed) {
+        throw std::invalid_argument(fmt::format(
+            FMT_STRING("Segment '{}': can't derive from streamed segment '{}'"),
+            seg.name,
+            derivation.base));
+    }
+    if (!in_progress.insert(seg.name).second) {
+        throw std::invalid_argument(
+            fmt::format(FMT_STRING("Segment '{}' is derived from itself"), seg.name));
+    }
+    const size_t base_length =
+        resolve_derived(filemap, base->second, lengths, in_progress);
+    in_progress.erase(seg.name);
+    if (derivation.offset > base_length) {
+        throw std::invalid_argument(fmt::format(
+            FMT_STRING("Segment '{}': offset {} is beyond the end of '{}' ({} samples)"),
+            seg.name,
+            derivation.offset,
+            derivation.base,
+            base_length));
+    }
+    const size_t available = base_length - derivation.offset;
+    const auto requested   = lengths.find(seg.name);
+    if (requested == lengths.end()) {
+        return seg.length = available;
+    }
+    if (requested->second > available) {
+        throw std::invalid_argument(fmt::format(
+            FMT_STRING("Segment '{}': {} samples requested, but only {} available from "
+                       "'{}'"),
+            seg.name,
+            requested->second,
+            available,
+            derivation.base));
+    }
+    return seg.length = requested->second;
+}
+} // namespace
+
 sequencer_data::sequencer_data(const json& data)
-    : def(data), settings(data.at("config").get<device_settings>())
+    : config(data.at("config")), settings(config.get<device_settings>())
 {
+    // Derived segments need their base's length, so they're resolved after the loop
+    const auto itemsize = static_cast<size_t>(settings.cpu_format);
+    std::map<std::string, size_t> derived_lengths;
     for (const auto& filespec : data.at("segments")) {
+        if (filespec.contains("base")) {
+            const std::string id = filespec.at("id");
+            fmt::print(FMT_STRING("segment \"{}\" derived from \"{}\"\n"),
+                id,
+                filespec.at("base"));
+            const segment_derivation derivation{.base = filespec.at("base"),
+                .offset    = filespec.value("offset", size_t(0)),
+                .gain      = filespec.value("gain", 1.0f),
+                .frequency = filespec.value("frequency_shift", 0.0) / settings.sampling_rate,
+                .phase     = filespec.value("phase", 0.0)};
+            filemap[id] = {.name = id,
+                .filename  = std::string{},
+                .length    = static_cast<size_t>(-1), /* from base, see below */
+                .itemsize  = itemsize,
+                .start_idx = static_cast<size_t>(-1),
+                .data      = nullptr,
+                .streamed  = false,
+                .derived   = derivation};
+            if (filespec.contains("length")) {
+                derived_lengths[id] = filespec.at("length").get<size_t>();
+            }
+            continue;
+        }
         fmt::print(FMT_STRING("segment \"{}\" from \"{}\"\n"),
             filespec.at("id"),
             filespec.at("sample_file"));
@@ -27,63 +264,185 @@ sequencer_data::sequencer_data(const json& data)
             fmt::print(stderr, "file '{:s}' not found\n", filespec.at("sample_file"));
             throw std::runtime_error("File Not Found");
         }
-        filemap[filespec.at("id")] = {filespec.at("id"),
-            filespec.at("sample_file"),
-            std::filesystem::file_size(filespec.at("sample_file"))
-                / static_cast<size_t>(settings.cpu_format),
-            static_cast<size_t>(-1), /* Can't set start offset before loading */
-            nullptr};
+        filemap[filespec.at("id")] = {.name = filespec.at("id"),
+            .filename = filespec.at("sample_file"),
+            .length   = std::filesystem::file_size(filespec.at("sample_file")) / itemsize,
+            .itemsize = itemsize,
+            .start_idx = static_cast<size_t>(-1), /* Can't set start offset before loading */
+            .data      = nullptr,
+            .streamed  = filespec.value("stream", false),
+            .derived   = std::nullopt};
+    }
+    std::set<std::string> in_progress;
+    for (auto& [id, seg] : filemap) {
+        resolve_derived(filemap, seg, derived_lengths, in_progress);
     }
 
-    for (const auto& entry : data.at("sequence")) {
+    // Streaming input may start without any sequence points
+    static const json no_points = json::array();
+    const auto& sequence = data.contains("sequence") ? data.at("sequence") : no_points;
+    static const json no_patterns = json::object();
+    body_parser bodies(data.contains("patterns") ? data.at("patterns") : no_patterns);
+    for (const auto& entry : sequence) {
         auto sp = entry.get<sequence_point>();
-        fmt::print(
-            FMT_STRING(
-                "Sequence point: Channel {}, start time {}, segment {}, repetitions{}\n"),
-            sp.channel,
-            sp.start_time,
-            sp.segment,
-            sp.repetitions);
-        used_channels[sp.channel].push_back(sp);
+        bodies.parse_loop(entry, sp);
+        used_channels[sp.channel].push_back(std::move(sp));
     }
 
-    // verify sequence does not overlap
-    for (auto& [channel, sp_vec] : used_channels) {
-        double next_start_earliest = 0;
-        fmt::print(FMT_STRING("Channel {}:\n"), channel);
-        for (auto& sp : sp_vec) {
-            fmt::print(
-                FMT_STRING("Encountered segment: {}, start time: {}, repetitions: {}\n"),
-                sp.segment,
-                sp.start_time,
-                sp.repetitions);
-            if (next_start_earliest > sp.start_time) {
-                fmt::print(stderr,
-                    FMT_STRING("Channel {}: start time {} is before the end of the "
-                               "previous segment ({}); adjusting.\n"),
-                    channel,
-                    sp.start_time,
-                    next_start_earliest);
-                sp.start_time = next_start_earliest;
-            }
-            if (sp.repetitions < 0) {
-                fmt::print(FMT_STRING("Channel {}: Looping segment {} forever, ignoring "
-                                      "further segments, as impossible to reach\n"),
-                    channel,
-                    sp.segment);
-                break;
-            }
-            try {
-                next_start_earliest = sp.start_time
-                                      + sp.repetitions * filemap.at(sp.segment).length
-                                            / settings.sampling_rate;
-            } catch (const std::out_of_range& err) {
-                fmt::print(stderr,
-                    FMT_STRING("Channel {}, Segment {}, {}\n"),
-                    channel,
-                    sp.segment,
-                    err.what());
+    const auto begin = std::chrono::steady_clock::now();
+    validate();
+    program = compile_program(*this);
+    mark_referenced();
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - begin;
+
+    report.print();
+    fmt::print(FMT_STRING("Validated {} sequence points on {} channels in {:.3f} s\n"),
+        sequence.size(),
+        used_channels.size(),
+        elapsed.count());
+}
+
+sequencer_data::sequencer_data(const json& config, device_settings settings)
+    : config(config), settings(std::move(settings))
+{
+}
+
+void sequencer_data::mark_referenced()
+{
+    if (!program.live.empty()) {
+        for (auto& [id, seg] : filemap) {
+            seg.referenced = true;
+        }
+        return;
+    }
+    std::vector<bool> played(program.segments.size(), false);
+    auto mark_played = [&played](std::span<const timeline_entry> entries) {
+        for (const auto& entry : entries) {
+            if (entry.block == timeline_entry::NO_BLOCK) {
+                played[entry.segment] = true;
             }
         }
+    };
+    for (const auto& [channel, timeline] : program.channels) {
+        mark_played(timeline);
+    }
+    for (const auto& block : program.blocks) {
+        mark_played(block);
+    }
+
+    for (auto& [id, seg] : filemap) {
+        seg.referenced = false;
+    }
+    for (size_t idx = 0; idx < played.size(); ++idx) {
+        if (!played[idx]) {
+            continue;
+        }
+        // and the bases it is derived from
+        for (auto* seg = &filemap.at(program.segments[idx]->name);
+             seg && !seg->referenced;
+             seg = seg->derived ? &filemap.at(seg->derived->base) : nullptr) {
+            seg->referenced = true;
+        }
+    }
+}
+
+void sequencer_data::validate()
+{
+    // Channels are independent; check them concurrently, and merge the reports in
+    // channel order so that the output doesn't depend on scheduling
+    std::map<size_t, std::future<validation_report>> results;
+    for (auto& [channel, sp_vec] : used_channels) {
+        results.emplace(channel,
+            std::async(std::launch::async, [this, channel = channel, &sp_vec = sp_vec]() {
+                validation_report channel_report;
+                body_checker checker(
+                    filemap, settings.sampling_rate, channel, channel_report);
+                const auto earlier = [](const auto& lhs, const auto& rhs) {
+                    return lhs.start_time < rhs.start_time;
+                };
+                // generated programs usually are in order already
+                if (!std::is_sorted(sp_vec.begin(), sp_vec.end(), earlier)) {
+                    std::stable_sort(sp_vec.begin(), sp_vec.end(), earlier);
+                }
+
+                double next_start_earliest = 0;
+                for (size_t idx = 0; idx < sp_vec.size(); ++idx) {
+                    auto& sp = sp_vec[idx];
+                    if (!sp.body && !filemap.contains(sp.segment)) {
+                        checker.duration(sp); // reports it
+                        continue;
+                    }
+                    const double item_duration = checker.duration(sp);
+                    if (next_start_earliest > sp.start_time) {
+                        ++channel_report.adjusted;
+                        channel_report.add_message(fmt::format(
+                            FMT_STRING("Channel {}: start time {} is before the end of "
+                                       "the previous segment ({}); adjusting."),
+                            channel,
+                            sp.start_time,
+                            next_start_earliest));
+                        sp.start_time = next_start_earliest;
+                    }
+                    if (sp.repetitions < 0) {
+                        if (idx + 1 < sp_vec.size()) {
+                            channel_report.unreachable += sp_vec.size() - idx - 1;
+                            channel_report.add_message(fmt::format(
+                                FMT_STRING("Channel {}: Looping segment {} forever, "
+                                           "ignoring {} further sequence points, as "
+                                           "impossible to reach"),
+                                channel,
+                                sp.body ? "loop" : sp.segment,
+                                sp_vec.size() - idx - 1));
+                        }
+                        break;
+                    }
+                    next_start_earliest =
+                        sp.start_time + std::max(sp.repetitions, 1) * item_duration;
+                }
+                return channel_report;
+            }));
+    }
+    for (auto& [channel, result] : results) {
+        report.merge(result.get());
+    }
+}
+
+void validation_report::add_message(std::string message)
+{
+    if (messages.size() < MAX_MESSAGES) {
+        messages.push_back(std::move(message));
+    } else {
+        ++suppressed;
+    }
+}
+
+void validation_report::merge(const validation_report& other)
+{
+    adjusted += other.adjusted;
+    unreachable += other.unreachable;
+    unknown_segment += other.unknown_segment;
+    invalid += other.invalid;
+    for (const auto& message : other.messages) {
+        add_message(message);
+    }
+    suppressed += other.suppressed;
+}
+
+void validation_report::print() const
+{
+    for (const auto& message : messages) {
+        fmt::print(stderr, FMT_STRING("{}\n"), message);
+    }
+    if (suppressed > 0) {
+        fmt::print(stderr, FMT_STRING("... and {} more\n"), suppressed);
+    }
+    if (total() > 0) {
+        fmt::print(stderr,
+            FMT_STRING("Sequence validation: {} points adjusted, {} unreachable, {} with "
+                       "undefined segments, {} invalid\n"),
+            adjusted,
+            unreachable,
+            unknown_segment,
+            invalid);
     }
 }
@@ -0,0 +1,74 @@
+/*
+ * Copyright 2023 Ettus Research, A National Instruments Brand
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+#include "multichannel_awg/sim_awg.hpp"
+#include "multichannel_awg/sequence.hpp"
+#include <uhd/stream.hpp>
+#include <fmt/format.h>
+#include <chrono>
+#include <memory>
+#include <string>
+
+sim_awg::sim_awg(const std::string& address, const std::atomic<bool>& stop)
+    : awg_base(address, stop), host_awg(address, stop)
+{
+}
+
+bool sim_awg::initialize()
+{
+    const auto& sim = settings.sim;
+    fmt::print(FMT_STRING("Initializing simulated device: {} S/s, link rate {}, buffer "
+                          "{} samples, {} samples per packet\n"),
+        sampling_rate,
+        sim.link_rate > 0 ? fmt::format(FMT_STRING("{:.3g} B/s"), sim.link_rate)
+                          : std::string("unlimited"),
+        sim.buffer_samples,
+        sim.max_samps);
+    // Same time base as a synchronized USRP
+    timekeeper.set_time_now(TIME_OFFSET);
+    return true;
+}
+
+bool sim_awg::start()
+{
+    const auto start  = std::chrono::steady_clock::now();
+    const bool result = host_awg::start();
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    uint64_t samples = 0;
+    for (const auto& streamer : streamers) {
+        samples += streamer->samples_sent() * streamer->get_num_channels();
+    }
+    fmt::print(FMT_STRING("Simulated device received {:L} samples in {:.3f} s ({:.3f} "
+                          "MS/s aggregate)\n"),
+        samples,
+        elapsed.count(),
+        elapsed.count() > 0 ? samples / elapsed.count() / 1e6 : 0.0);
+    return result;
+}
+
+std::shared_ptr<uhd::tx_streamer> sim_awg::make_tx_stream(
+    const uhd::stream_args_t& stream_args)
+{
+    const auto itemsize = static_cast<size_t>(settings.cpu_format);
+    auto streamer       = std::make_shared<sim_tx_streamer>(timekeeper,
+        stream_args.channels,
+        itemsize,
+        sampling_rate,
+        settings.sim);
+    streamers.push_back(streamer);
+    return streamer;
+}
+
+double sim_awg::device_time()
+{
+    return timekeeper.time_now();
+}
+
+sim_awg::~sim_awg()
+{
+    ;
+}
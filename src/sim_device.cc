@@ -0,0 +1,175 @@
+/*
+ * Copyright 2023 Ettus Research, A National Instruments Brand
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+#include "multichannel_awg/sim_device.hpp"
+#include <uhd/exception.hpp>
+#include <uhd/types/time_spec.hpp>
+#include <fmt/format.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <thread>
+
+double sim_timekeeper::time_now() const
+{
+    return device_ref
+           + std::chrono::duration<double>(std::chrono::steady_clock::now() - host_ref)
+                 .count();
+}
+
+void sim_timekeeper::set_time_now(double time)
+{
+    host_ref   = std::chrono::steady_clock::now();
+    device_ref = time;
+}
+
+sim_tx_streamer::sim_tx_streamer(const sim_timekeeper& timekeeper,
+    const std::vector<size_t>& channels,
+    size_t itemsize,
+    double sampling_rate,
+    const sim_settings& settings)
+    : timekeeper(timekeeper)
+    , num_channels(channels.size())
+    , itemsize(itemsize)
+    , sampling_rate(sampling_rate)
+    , settings(settings)
+{
+    for (auto channel : channels) {
+        const auto sink = settings.sinks.find(channel);
+        if (sink == settings.sinks.end() || sink->second.empty()) {
+            sinks.push_back(nullptr);
+            continue;
+        }
+        auto file = std::make_unique<std::ofstream>(sink->second, std::ios::binary);
+        if (!*file) {
+            throw uhd::io_error(fmt::format(
+                FMT_STRING("Could not open sink '{}' for channel {}"), sink->second, channel));
+        }
+        fmt::print(FMT_STRING("Simulated channel {} writes to '{}'\n"), channel, sink->second);
+        sinks.push_back(std::move(file));
+    }
+}
+
+size_t sim_tx_streamer::get_num_channels() const
+{
+    return num_channels;
+}
+
+size_t sim_tx_streamer::get_max_num_samps() const
+{
+    return settings.max_samps;
+}
+
+size_t sim_tx_streamer::send(const buffs_type& buffs,
+    const size_t nsamps_per_buff,
+    const uhd::tx_metadata_t& metadata,
+    const double timeout)
+{
+    using clock        = std::chrono::steady_clock;
+    const auto give_up =
+        clock::now()
+        + std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(timeout));
+
+    const double now = timekeeper.time_now();
+    if (metadata.has_time_spec) {
+        const double start = metadata.time_spec.get_real_secs();
+        if (start < now) {
+            // a real device drops late packets; we just play them as soon as possible
+            post_event(uhd::async_metadata_t::EVENT_CODE_TIME_ERROR, now);
+        }
+        burst_start = std::max(start, now);
+        play_until  = burst_start;
+        in_burst    = true;
+    } else if (!in_burst) {
+        burst_start = now;
+        play_until  = now;
+        in_burst    = true;
+    } else if (nsamps_per_buff > 0 && now > play_until) {
+        // the buffer ran dry before this packet arrived
+        post_event(uhd::async_metadata_t::EVENT_CODE_UNDERFLOW, play_until);
+        play_until = now;
+    }
+
+    size_t sent = 0;
+    while (sent < nsamps_per_buff) {
+        // Samples sent, but not yet played, occupy the device buffer
+        const double device_now  = timekeeper.time_now();
+        const double outstanding =
+            (play_until - std::max(device_now, burst_start)) * sampling_rate;
+        const double space = static_cast<double>(settings.buffer_samples) - outstanding;
+        if (space < 1.0) {
+            if (clock::now() >= give_up) {
+                break;
+            }
+            const auto wait = std::chrono::duration_cast<clock::duration>(
+                std::chrono::duration<double>((1.0 - space) / sampling_rate));
+            std::this_thread::sleep_until(std::min(give_up, clock::now() + wait));
+            continue;
+        }
+        const size_t chunk =
+            std::min(nsamps_per_buff - sent, static_cast<size_t>(space));
+
+        if (settings.link_rate > 0) {
+            const std::chrono::duration<double> transfer(
+                static_cast<double>(chunk * itemsize * num_channels) / settings.link_rate);
+            link_free = std::max(link_free, clock::now())
+                        + std::chrono::duration_cast<clock::duration>(transfer);
+            std::this_thread::sleep_until(link_free);
+        }
+        for (size_t idx = 0; idx < num_channels; ++idx) {
+            if (sinks[idx]) {
+                sinks[idx]->write(static_cast<const char*>(buffs[idx]) + sent * itemsize,
+                    static_cast<std::streamsize>(chunk * itemsize));
+            }
+        }
+        play_until += static_cast<double>(chunk) / sampling_rate;
+        sent += chunk;
+    }
+    total_samples += sent;
+
+    if (metadata.end_of_burst && sent == nsamps_per_buff) {
+        post_event(uhd::async_metadata_t::EVENT_CODE_BURST_ACK, play_until);
+        in_burst = false;
+    }
+    return sent;
+}
+
+bool sim_tx_streamer::recv_async_msg(uhd::async_metadata_t& async_metadata, double timeout)
+{
+    std::unique_lock<std::mutex> lock(async_mutex);
+    if (!async_cond.wait_for(lock, std::chrono::duration<double>(timeout), [this]() {
+            return !async_queue.empty();
+        })) {
+        return false;
+    }
+    async_metadata = async_queue.front();
+    async_queue.pop_front();
+    return true;
+}
+
+#if UHD_VERSION >= 4050000
+void sim_tx_streamer::post_output_action(
+    const std::shared_ptr<uhd::rfnoc::action_info>&, const size_t)
+{
+    throw uhd::not_implemented_error("Actions are not supported by the simulated device");
+}
+#endif
+
+void sim_tx_streamer::post_event(uhd::async_metadata_t::event_code_t code, double time)
+{
+    {
+        std::lock_guard<std::mutex> lock(async_mutex);
+        for (size_t channel = 0; channel < num_channels; ++channel) {
+            uhd::async_metadata_t md;
+            md.channel       = channel;
+            md.has_time_spec = true;
+            md.time_spec     = uhd::time_spec_t(time);
+            md.event_code    = code;
+            async_queue.push_back(md);
+        }
+    }
+    async_cond.notify_one();
+}
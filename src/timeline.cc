@@ -0,0 +1,229 @@
+/*
+ * Copyright 2023 Ettus Research, A National Instruments Brand
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+#include "multichannel_awg/timeline.hpp"
+#include "multichannel_awg/sequence.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <string>
+#include <chrono>
+#include <map>
+#include <tuple>
+#include <mutex>
+#include <span>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+compiled_program compile_program(const sequencer_data& data)
+{
+    compiled_program program;
+    program.sampling_rate = data.settings.sampling_rate;
+
+    // Segment indices in name order, so they don't depend on hashing
+    for (const auto& [id, seg] : data.filemap) {
+        program.segments.push_back(&seg);
+    }
+    std::sort(program.segments.begin(),
+        program.segments.end(),
+        [](const auto* lhs, const auto* rhs) { return lhs->name < rhs->name; });
+
+    // Channel timelines are laid out one after another in program.entries
+    std::map<size_t, std::pair<size_t, size_t>> ranges;
+    auto& entries = program.entries;
+    timeline_builder builder(program);
+    for (const auto& [channel, sp_vec] : data.used_channels) {
+        const size_t first = entries.size();
+        for (const auto& sp : sp_vec) {
+            timeline_entry entry;
+            const auto result = builder.add(sp, entry);
+            if (result == timeline_builder::status::ADDED
+                || result == timeline_builder::status::DELAYED) {
+                entries.push_back(entry);
+            }
+        }
+        ranges[channel] = {first, entries.size() - first};
+    }
+    // Loop bodies go after the channels
+    const size_t blocks_start = entries.size();
+    entries.insert(
+        entries.end(), builder.block_entries.begin(), builder.block_entries.end());
+
+    const std::span<const timeline_entry> all(entries);
+    for (const auto& [channel, range] : ranges) {
+        program.channels[channel] = all.subspan(range.first, range.second);
+    }
+    for (const auto& [first, count] : builder.block_ranges) {
+        program.blocks.push_back(all.subspan(blocks_start + first, count));
+    }
+    return program;
+}
+
+timeline_builder::timeline_builder(const compiled_program& program) : program(program)
+{
+    for (uint32_t idx = 0; idx < program.segments.size(); ++idx) {
+        index.emplace(program.segments[idx]->name, idx);
+    }
+    for (const auto& [channel, timeline] : program.channels) {
+        if (!timeline.empty()) {
+            earliest[channel] = timeline.back().end_tick();
+        }
+    }
+}
+
+timeline_builder::status timeline_builder::add(
+    const sequence_point& sp, timeline_entry& entry)
+{
+    auto& next_earliest = earliest[sp.channel];
+    if (next_earliest == UINT64_MAX) {
+        return status::UNREACHABLE;
+    }
+    uint32_t segment = 0;
+    uint32_t block   = timeline_entry::NO_BLOCK;
+    uint64_t length  = 0;
+    if (sp.body) {
+        std::tie(block, length) = compile_body(*sp.body);
+    } else {
+        const auto known = index.find(sp.segment);
+        if (known == index.end()) {
+            return status::UNKNOWN_SEGMENT;
+        }
+        segment = known->second;
+        length  = program.segments[segment]->length;
+    }
+    if (length == 0) {
+        return status::EMPTY_SEGMENT;
+    }
+    const auto requested = static_cast<uint64_t>(
+        std::llround(std::max(sp.start_time, 0.0) * program.sampling_rate));
+    entry = {segment,
+        block,
+        0,
+        length,
+        std::max(requested, next_earliest),
+        sp.repetitions < 0 ? timeline_entry::FOREVER
+                           : static_cast<uint64_t>(std::max(sp.repetitions, 1))};
+    next_earliest = entry.end_tick();
+    return entry.start_tick > requested ? status::DELAYED : status::ADDED;
+}
+
+std::pair<uint32_t, uint64_t> timeline_builder::compile_body(const sequence_body& body)
+{
+    if (const auto known = bodies.find(&body); known != bodies.end()) {
+        return known->second;
+    }
+    // Items start right after each other, plus their gap; an endless item inside a
+    // loop is played once (the validator reports it)
+    std::vector<timeline_entry> items;
+    uint64_t tick = 0;
+    for (const auto& item : body) {
+        tick += static_cast<uint64_t>(
+            std::llround(std::max(item.gap, 0.0) * program.sampling_rate));
+        uint32_t segment = 0;
+        uint32_t block   = timeline_entry::NO_BLOCK;
+        uint64_t length  = 0;
+        if (item.body) {
+            std::tie(block, length) = compile_body(*item.body);
+        } else if (const auto known = index.find(item.segment); known != index.end()) {
+            segment = known->second;
+            length  = program.segments[segment]->length;
+        }
+        if (length == 0) {
+            continue;
+        }
+        const auto passes = static_cast<uint64_t>(std::max(item.repetitions, 1));
+        items.push_back({segment, block, 0, length, tick, passes});
+        tick += length * passes;
+    }
+    if (items.empty()) {
+        return bodies[&body] = {0, 0};
+    }
+    const auto block = static_cast<uint32_t>(block_ranges.size());
+    block_ranges.emplace_back(block_entries.size(), items.size());
+    block_entries.insert(block_entries.end(), items.begin(), items.end());
+    return bodies[&body] = {block, tick};
+}
+
+timeline_cursor::timeline_cursor(const compiled_program& program,
+    std::span<const timeline_entry> timeline,
+    uint64_t max_passes)
+    : program(&program), max_passes(max_passes)
+{
+    // the timeline itself is a single pass whose entries have absolute start ticks
+    levels.push_back({timeline, 0, 0, 1, 0, 0});
+}
+
+bool timeline_cursor::next(timeline_entry& entry)
+{
+    while (!levels.empty()) {
+        auto& current = levels.back();
+        if (current.index == current.entries.size()) {
+            // every pass, endless ones included, starts one pass length later
+            const bool more = current.passes == timeline_entry::FOREVER
+                              || current.pass + 1 < current.passes;
+            if (more && current.pass + 1 < max_passes) {
+                ++current.pass;
+                current.index = 0;
+            } else {
+                cut_short = cut_short || more;
+                levels.pop_back();
+            }
+            continue;
+        }
+        const auto& next = current.entries[current.index++];
+        const uint64_t start_tick =
+            current.start_tick + current.pass * current.length + next.start_tick;
+        if (next.block == timeline_entry::NO_BLOCK) {
+            entry            = next;
+            entry.start_tick = start_tick;
+            return true;
+        }
+        // invalidates current
+        levels.push_back(
+            {program->blocks[next.block], 0, 0, next.repeat_count, start_tick, next.length});
+    }
+    return false;
+}
+
+bool timeline_queue::push(const timeline_entry& entry, const std::atomic<bool>& stop)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    // wake up regularly to notice a stop request
+    while (entries.size() >= capacity) {
+        if (stop.load()) {
+            return false;
+        }
+        not_full.wait_for(lock, std::chrono::milliseconds(100));
+    }
+    entries.push_back(entry);
+    not_empty.notify_one();
+    return true;
+}
+
+timeline_queue::status timeline_queue::pop(
+    timeline_entry& entry, std::chrono::milliseconds timeout)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    if (!not_empty.wait_for(
+            lock, timeout, [this]() { return !entries.empty() || closed; })) {
+        return status::TIMEOUT;
+    }
+    if (entries.empty()) {
+        return status::CLOSED;
+    }
+    entry = entries.front();
+    entries.pop_front();
+    not_full.notify_one();
+    return status::ENTRY;
+}
+
+void timeline_queue::close()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    closed = true;
+    not_empty.notify_all();
+}
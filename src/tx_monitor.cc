@@ -0,0 +1,132 @@
+/*
+ * Copyright 2023 Ettus Research, A National Instruments Brand
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+#include "multichannel_awg/tx_monitor.hpp"
+#include <uhd/stream.hpp>
+#include <uhd/types/metadata.hpp>
+#include <uhd/utils/thread.hpp>
+#include <nlohmann/json.hpp>
+#include <fmt/format.h>
+#include <cmath>
+#include <limits>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+void tx_event_counter::record(double time)
+{
+    // single writer: publish the time before the count, so a reader that sees a non-zero
+    // count also sees the time
+    if (count.load(std::memory_order_relaxed) == 0) {
+        first_time.store(time, std::memory_order_relaxed);
+    }
+    count.fetch_add(1, std::memory_order_release);
+}
+
+nlohmann::json tx_event_counters::to_json(double time_offset) const
+{
+    auto describe = [time_offset](const tx_event_counter& counter) {
+        const auto count      = counter.count.load(std::memory_order_acquire);
+        nlohmann::json result = {{"count", count}};
+        // left out if the first event came without a time
+        if (const double first = counter.first_time.load(); count > 0 && !std::isnan(first)) {
+            result["first_time"] = first - time_offset;
+        }
+        return result;
+    };
+    return {{"underflow", describe(underflow)},
+        {"seq_error", describe(seq_error)},
+        {"time_error", describe(time_error)},
+        {"burst_ack", describe(burst_ack)}};
+}
+
+tx_event_monitor::tx_event_monitor(std::shared_ptr<uhd::tx_streamer> streamer,
+    const std::vector<size_t>& channels,
+    std::map<size_t, tx_event_counters>& counter_map)
+    : streamer(std::move(streamer))
+{
+    for (auto channel : channels) {
+        counters.push_back(&counter_map.at(channel));
+    }
+    thread = std::thread(&tx_event_monitor::run, this);
+    uhd::set_thread_name(&thread,
+        fmt::format(FMT_STRING("awg_async{}"), channels.empty() ? 0 : channels.front()));
+}
+
+tx_event_monitor::~tx_event_monitor()
+{
+    running.store(false);
+    thread.join();
+}
+
+bool tx_event_monitor::poll(double timeout)
+{
+    uhd::async_metadata_t md;
+    if (!streamer->recv_async_msg(md, timeout)) {
+        return false;
+    }
+    if (md.channel >= counters.size()) {
+        return true;
+    }
+    tx_event_counters& channel_counters = *counters[md.channel];
+    const double time = md.has_time_spec ? md.time_spec.get_real_secs()
+                                         : std::numeric_limits<double>::quiet_NaN();
+    switch (md.event_code) {
+        case uhd::async_metadata_t::EVENT_CODE_BURST_ACK:
+            channel_counters.burst_ack.record(time);
+            break;
+        case uhd::async_metadata_t::EVENT_CODE_UNDERFLOW:
+        case uhd::async_metadata_t::EVENT_CODE_UNDERFLOW_IN_PACKET:
+            channel_counters.underflow.record(time);
+            break;
+        case uhd::async_metadata_t::EVENT_CODE_SEQ_ERROR:
+        case uhd::async_metadata_t::EVENT_CODE_SEQ_ERROR_IN_BURST:
+            channel_counters.seq_error.record(time);
+            break;
+        case uhd::async_metadata_t::EVENT_CODE_TIME_ERROR:
+            channel_counters.time_error.record(time);
+            break;
+        default:
+            break;
+    }
+    return true;
+}
+
+void tx_event_monitor::run()
+{
+    while (running.load()) {
+        poll(0.1);
+    }
+    // Pick up what arrived after the last burst
+    while (poll(0.1)) {
+    }
+}
+
+void print_tx_events(const std::map<size_t, tx_event_counters>& counters, double time_offset)
+{
+    auto describe = [time_offset](const tx_event_counter& counter) {
+        const auto count = counter.count.load();
+        if (count == 0) {
+            return std::string("0");
+        }
+        const double first = counter.first_time.load();
+        if (std::isnan(first)) {
+            return fmt::format(FMT_STRING("{} (first at an unknown time)"), count);
+        }
+        return fmt::format(
+            FMT_STRING("{} (first at {:.6f} s)"), count, first - time_offset);
+    };
+    for (const auto& [channel, channel_counters] : counters) {
+        fmt::print(FMT_STRING("Channel {}: underflows {}, sequence errors {}, late packets "
+                              "{}, burst ACKs {}\n"),
+            channel,
+            describe(channel_counters.underflow),
+            describe(channel_counters.seq_error),
+            describe(channel_counters.time_error),
+            describe(channel_counters.burst_ack));
+    }
+}